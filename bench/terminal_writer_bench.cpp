@@ -0,0 +1,65 @@
+// Syscall count per 1k streamed tokens: flushing each token (the old
+// std::cout << token << std::flush path) vs the coalescing TerminalWriter.
+//
+// Usage: terminal_writer_bench [tokens] [token_interval_us]
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "../src/terminal_output.hpp"
+
+// Token-sized pieces of a typical answer, roughly one newline every dozen tokens
+static std::vector<std::string> make_tokens(size_t count) {
+    static const char* words[] = {"The", " command", " lists", " all", " files", " in", " the", " current",
+                                  " directory", ",", " including", " hidden", " ones", ".\n"};
+    std::vector<std::string> tokens;
+    for (size_t i = 0; i < count; ++i) {
+        tokens.push_back(words[i % (sizeof(words) / sizeof(words[0]))]);
+    }
+    return tokens;
+}
+
+int main(int argc, char** argv) {
+    size_t token_count = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1000;
+    auto token_interval = std::chrono::microseconds(argc > 2 ? std::atol(argv[2]) : 1000);
+    auto tokens = make_tokens(token_count);
+
+    int fd = open("/dev/null", O_WRONLY);
+    if (fd == -1) {
+        perror("open /dev/null");
+        return 1;
+    }
+
+    // Per-token flush: one write(2) per token
+    size_t naive_syscalls = 0;
+    for (const auto& token : tokens) {
+        if (::write(fd, token.data(), token.size()) >= 0) {
+            naive_syscalls++;
+        }
+        std::this_thread::sleep_for(token_interval);
+    }
+
+    size_t coalesced_syscalls;
+    {
+        TerminalWriter writer(fd);
+        for (const auto& token : tokens) {
+            writer.write(token);
+            std::this_thread::sleep_for(token_interval);
+        }
+        writer.flush();
+        coalesced_syscalls = writer.syscalls();
+    }
+    close(fd);
+
+    double per_1k = 1000.0 / token_count;
+    std::cout << "tokens:            " << token_count << " (every " << token_interval.count() << " us)" << std::endl;
+    std::cout << "per-token flush:   " << naive_syscalls * per_1k << " syscalls / 1k tokens" << std::endl;
+    std::cout << "TerminalWriter:    " << coalesced_syscalls * per_1k << " syscalls / 1k tokens" << std::endl;
+    return 0;
+}
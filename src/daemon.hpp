@@ -0,0 +1,569 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "ollama.hpp"
+#include "completion.hpp"
+
+// Resident daemon mode.
+//
+// `terminal_ai_test --daemon` keeps the expensive state alive in one process:
+// the HTTP connections to Ollama, the model list and the PATH scan used for
+// completion. Every other terminal connects to it over a Unix domain socket and
+// becomes a thin client. The wire protocol is newline-delimited JSON, one
+// request object per line:
+//
+//   {"op":"hello","session":"name","temporary":false}
+//                                     -> {"ok":true,"history":[...],"revision":r}
+//   {"op":"models","refresh":false}   -> {"models":[...]}
+//   {"op":"executables"}              -> {"executables":[...]}
+//   {"op":"capabilities","model":"m"} -> {"capabilities":[...]}
+//   {"op":"chat","model":"m","think":false,"tools":[...],"base":n,"revision":r,"messages":[...]}
+//                                     -> {"thinking":"..."} / {"chunk":"..."} / {"tool_call":{...}} ...
+//                                        {"done":true,"response":"...","revision":r}
+//
+// A chat request only carries the messages after the first `base` ones the
+// daemon already holds for the session. The session's revision changes with
+// every turn, so `base` only counts while the revision is the one the client
+// saw last; otherwise (e.g. another client chatted in between) the daemon
+// answers {"error":"resync"} and the client resends everything with base 0.
+//
+// Any request the daemon cannot handle, including one with fields of the wrong
+// type, is answered with {"error":"..."} and the connection stays open.
+//
+// Sessions are keyed by name, so several clients may attach to the same one
+// and see the same conversation. A session only ever attached as temporary
+// (a terminal without --session) is dropped when its last client disconnects.
+
+// Private directory for the socket when there is no $XDG_RUNTIME_DIR
+inline std::string fallback_socket_dir() {
+    return "/tmp/terminal_ai-" + std::to_string(getuid());
+}
+
+// Socket location: $TERMINAL_AI_SOCKET, else $XDG_RUNTIME_DIR, else a 0700
+// directory in /tmp.
+inline std::string daemon_socket_path() {
+    if (const char* path = getenv("TERMINAL_AI_SOCKET")) {
+        return path;
+    }
+    if (const char* runtime_dir = getenv("XDG_RUNTIME_DIR")) {
+        return std::string(runtime_dir) + "/terminal_ai.sock";
+    }
+    return fallback_socket_dir() + "/daemon.sock";
+}
+
+// Creates `dir` as 0700, or checks that an existing one is a real directory
+// that only we can get into, so nobody else can bind or swap our socket
+inline bool ensure_private_dir(const std::string& dir) {
+    if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST) {
+        std::cerr << "Cannot create " << dir << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    struct stat st;
+    if (lstat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077) != 0) {
+        std::cerr << "Refusing to use " << dir << ": not a private directory owned by this user" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// True when the process on the other end of a Unix socket runs as our user
+inline bool peer_is_same_user(int fd) {
+    ucred cred{};
+    socklen_t len = sizeof(cred);
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == getuid();
+}
+
+// Line-oriented JSON framing over a connected socket
+class LineSocket {
+public:
+    explicit LineSocket(int fd) : fd(fd) {}
+
+    ~LineSocket() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    LineSocket(const LineSocket&) = delete;
+    LineSocket& operator=(const LineSocket&) = delete;
+
+    bool send(const json& j) {
+        // Invalid UTF-8 (e.g. from command output) is replaced, never thrown on
+        std::string line = j.dump(-1, ' ', false, json::error_handler_t::replace) + "\n";
+        size_t sent = 0;
+        while (sent < line.size()) {
+            ssize_t n = ::send(fd, line.data() + sent, line.size() - sent, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            sent += n;
+        }
+        return true;
+    }
+
+    // Returns false on EOF/error, or when `cancel_fd` becomes readable first
+    // (interrupted() tells the two apart)
+    bool receive(json& j, int cancel_fd = -1) {
+        size_t pos;
+        interrupted_ = false;
+        while ((pos = buffer.find('\n')) == std::string::npos) {
+            if (cancel_fd >= 0) {
+                pollfd fds[2] = {{fd, POLLIN, 0}, {cancel_fd, POLLIN, 0}};
+                if (poll(fds, 2, -1) < 0 && errno != EINTR) return false;
+                if (fds[1].revents & POLLIN) {
+                    interrupted_ = true;
+                    return false;
+                }
+                if (!(fds[0].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            }
+            char chunk[4096];
+            ssize_t n = ::recv(fd, chunk, sizeof(chunk), 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            buffer.append(chunk, n);
+        }
+        std::string line = buffer.substr(0, pos);
+        buffer.erase(0, pos + 1);
+        try {
+            j = json::parse(line);
+        } catch (const std::exception& e) {
+            std::cerr << "Daemon protocol error: " << e.what() << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    bool interrupted() const {
+        return interrupted_;
+    }
+
+    int handle() const {
+        return fd;
+    }
+
+private:
+    int fd;
+    std::string buffer;
+    bool interrupted_ = false;
+};
+
+inline int connect_unix_socket(const std::string& path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    if (!peer_is_same_user(fd)) {
+        std::cerr << "Ignoring daemon socket " << path << ": it belongs to another user" << std::endl;
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+class DaemonServer {
+public:
+    DaemonServer(const std::string& socket_path = daemon_socket_path()) : socket_path(socket_path) {}
+
+    int run() {
+        size_t slash = socket_path.find_last_of('/');
+        if (slash != std::string::npos && socket_path.substr(0, slash) == fallback_socket_dir() &&
+            !ensure_private_dir(fallback_socket_dir())) {
+            return 1;
+        }
+
+        // Refuse to start twice; otherwise clear a stale socket left by a crash
+        int probe = connect_unix_socket(socket_path);
+        if (probe != -1) {
+            close(probe);
+            std::cerr << "Daemon already running on " << socket_path << std::endl;
+            return 1;
+        }
+        unlink(socket_path.c_str());
+
+        int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listen_fd == -1) {
+            perror("socket");
+            return 1;
+        }
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+        // Created 0600 from the start; a chmod() after bind() leaves a window
+        mode_t old_mask = umask(077);
+        int bound = bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+        umask(old_mask);
+        if (bound == -1) {
+            perror("bind");
+            close(listen_fd);
+            return 1;
+        }
+        if (listen(listen_fd, 16) == -1) {
+            perror("listen");
+            close(listen_fd);
+            return 1;
+        }
+
+        // Warm up shared state once for every client
+        std::cout << "Scanning PATH..." << std::endl;
+        executables = get_executables();
+        std::cout << "Fetching models..." << std::endl;
+        models = models_client.list_models();
+        if (!models.empty()) {
+            // Clients start on the first model; have it in memory before they ask
+            const std::string& model = models.front();
+            model_capabilities[model] = models_client.capabilities(model);
+            std::cout << "Loading " << model << " in the background..." << std::endl;
+            std::thread([model] {
+                Ollama loader;
+                if (!loader.load(model)) {
+                    std::cerr << "Could not preload " << model << std::endl;
+                }
+            }).detach();
+        }
+        std::cout << "Daemon listening on " << socket_path << std::endl;
+
+        while (true) {
+            int client_fd = accept(listen_fd, nullptr, nullptr);
+            if (client_fd == -1) {
+                if (errno == EINTR) continue;
+                perror("accept");
+                break;
+            }
+            if (!peer_is_same_user(client_fd)) {
+                close(client_fd);
+                continue;
+            }
+            std::thread(&DaemonServer::serve_client, this, client_fd).detach();
+        }
+
+        close(listen_fd);
+        unlink(socket_path.c_str());
+        return 0;
+    }
+
+private:
+    struct Session {
+        std::mutex mutex;
+        std::vector<Message> history;
+        uint64_t revision = 0; // Bumped whenever history changes
+        Ollama ollama; // Each session keeps its own warm connection
+        size_t clients = 0; // Guarded by sessions_mutex, like the two below
+        bool temporary = true;
+        std::string name;
+    };
+
+    std::string socket_path;
+    std::vector<std::string> executables;
+
+    std::mutex models_mutex;
+    std::vector<std::string> models;
+    std::map<std::string, std::vector<std::string>> model_capabilities;
+    Ollama models_client;
+
+    std::mutex sessions_mutex;
+    std::map<std::string, std::unique_ptr<Session>> sessions;
+
+    Session* attach_session(const std::string& name, bool temporary) {
+        std::lock_guard<std::mutex> lock(sessions_mutex);
+        auto& session = sessions[name];
+        if (!session) {
+            session = std::make_unique<Session>();
+            session->name = name;
+        }
+        session->temporary = session->temporary && temporary;
+        session->clients++;
+        return session.get();
+    }
+
+    void detach_session(Session* session) {
+        if (!session) return;
+        std::lock_guard<std::mutex> lock(sessions_mutex);
+        if (--session->clients == 0 && session->temporary) {
+            sessions.erase(session->name);
+        }
+    }
+
+    void serve_client(int client_fd) {
+        LineSocket conn(client_fd);
+        Session* session = nullptr;
+        json request;
+
+        while (conn.receive(request)) {
+            // A malformed request (wrong field types, bad messages) gets an error
+            // reply instead of taking the whole daemon down
+            bool ok = true;
+            try {
+                std::string op = request.value("op", "");
+
+                if (op == "hello") {
+                    std::string name = request.value("session", "default");
+                    bool temporary = request.value("temporary", false);
+                    Session* next = attach_session(name, temporary);
+                    detach_session(session);
+                    session = next;
+                    std::lock_guard<std::mutex> lock(session->mutex);
+                    ok = conn.send({{"ok", true}, {"history", session->history}, {"revision", session->revision}});
+                } else if (op == "models") {
+                    std::lock_guard<std::mutex> lock(models_mutex);
+                    if (request.value("refresh", false) || models.empty()) {
+                        models = models_client.list_models();
+                    }
+                    ok = conn.send({{"models", models}});
+                } else if (op == "capabilities") {
+                    std::lock_guard<std::mutex> lock(models_mutex);
+                    std::string model = request.value("model", "");
+                    auto it = model_capabilities.find(model);
+                    if (it == model_capabilities.end()) {
+                        it = model_capabilities.emplace(model, models_client.capabilities(model)).first;
+                    }
+                    ok = conn.send({{"capabilities", it->second}});
+                } else if (op == "executables") {
+                    ok = conn.send({{"executables", executables}});
+                } else if (op == "chat") {
+                    if (!session) {
+                        session = attach_session("default", false);
+                    }
+                    std::lock_guard<std::mutex> lock(session->mutex);
+                    size_t base = request.value("base", size_t(0));
+                    bool current = base == 0 || request.value("revision", uint64_t(0)) == session->revision;
+                    if (!current || base > session->history.size()) {
+                        ok = conn.send({{"error", "resync"}});
+                    } else {
+                        // Parsed before the history is touched, so a bad message leaves it intact
+                        std::vector<Message> delta = request.value("messages", json::array()).get<std::vector<Message>>();
+                        session->history.resize(base);
+                        session->history.insert(session->history.end(), delta.begin(), delta.end());
+
+                        // The client hanging up (e.g. on Ctrl-C) makes its socket
+                        // readable, which aborts the generation right away; a failed
+                        // send catches the same thing between chunks
+                        std::string streamed;
+                        std::string thinking;
+                        std::vector<ToolCall> tool_calls;
+                        auto forward = [&](const std::string& chunk) -> bool {
+                            streamed += chunk;
+                            return conn.send({{"chunk", chunk}});
+                        };
+                        auto forward_thinking = [&](const std::string& chunk) -> bool {
+                            thinking += chunk;
+                            return conn.send({{"thinking", chunk}});
+                        };
+                        auto forward_tool_call = [&](const ToolCall& call) -> bool {
+                            tool_calls.push_back(call);
+                            return conn.send({{"tool_call", call}});
+                        };
+                        session->ollama.set_cancel_fd(conn.handle());
+                        std::string response = session->ollama.chat(request.value("model", ""), session->history, forward,
+                                                                     request.value("think", false) ? StreamCallback(forward_thinking) : nullptr,
+                                                                     request.value("tools", json::array()), forward_tool_call);
+                        session->ollama.set_cancel_fd(-1);
+                        if (!streamed.empty() || !tool_calls.empty()) {
+                            response = streamed; // Keep the partial reply of an aborted generation
+                        }
+                        session->history.push_back({"assistant", response, thinking, tool_calls});
+                        session->revision++;
+                        ok = conn.send({{"done", true}, {"response", response}, {"revision", session->revision}});
+                    }
+                } else {
+                    ok = conn.send({{"error", "unknown op: " + op}});
+                }
+            } catch (const std::exception& e) {
+                ok = conn.send({{"error", std::string("bad request: ") + e.what()}});
+            }
+            if (!ok) break;
+        }
+        detach_session(session);
+    }
+};
+
+// Thin client used by interactive terminals when a daemon is running
+class DaemonClient : public ChatBackend {
+public:
+    // Returns nullptr when no daemon is listening
+    // A `temporary` session is dropped by the daemon once no client uses it
+    static std::unique_ptr<DaemonClient> connect(const std::string& session, bool temporary,
+                                                 const std::string& socket_path = daemon_socket_path()) {
+        std::unique_ptr<DaemonClient> client(new DaemonClient(session, temporary, socket_path));
+        json reply;
+        if (!client->attach(reply)) {
+            return nullptr;
+        }
+        client->attached_history = reply.value("history", std::vector<Message>{});
+        client->synced = client->attached_history.size();
+        client->revision = reply.value("revision", uint64_t(0));
+        return client;
+    }
+
+    // History of the session at attach time (empty for a new session)
+    const std::vector<Message>& history() const {
+        return attached_history;
+    }
+
+    // The first call uses the daemon's warm list; later calls (e.g. `!model`)
+    // ask it to refresh so newly pulled models show up
+    std::vector<std::string> list_models() override {
+        json reply;
+        if (!request({{"op", "models"}, {"refresh", models_fetched}}, reply)) {
+            std::cerr << "Failed to get models: daemon connection lost" << std::endl;
+            return {};
+        }
+        models_fetched = true;
+        return reply.value("models", std::vector<std::string>{});
+    }
+
+    std::vector<std::string> capabilities(const std::string& model) override {
+        json reply;
+        if (!request({{"op", "capabilities"}, {"model", model}}, reply)) {
+            return {};
+        }
+        return reply.value("capabilities", std::vector<std::string>{});
+    }
+
+    std::vector<std::string> executables() {
+        json reply;
+        if (!request({{"op", "executables"}}, reply)) {
+            return {};
+        }
+        return reply.value("executables", std::vector<std::string>{});
+    }
+
+    std::string chat(const std::string& model, const std::vector<Message>& messages, StreamCallback callback = nullptr, StreamCallback thinking_callback = nullptr,
+                     const json& tools = json::array(), ToolCallback tool_callback = nullptr) override {
+        json reply;
+        bool think = thinking_callback != nullptr;
+        // The first reply only comes once the model is loaded and the prompt
+        // evaluated, so Ctrl-C has to work while waiting for it too
+        bool cancelled = false;
+        bool sent = request(chat_request(model, messages, think, tools), reply, cancel_fd, &cancelled);
+        if (sent && reply.value("error", "") == "resync") {
+            synced = 0;
+            sent = request(chat_request(model, messages, think, tools), reply, cancel_fd, &cancelled);
+        }
+        if (!sent) {
+            revision = UNKNOWN_REVISION;
+            return cancelled ? "Error: cancelled" : "Error: daemon connection lost";
+        }
+        // The daemon now holds all of `messages`; it appends its own copy of
+        // the reply, which the next request replaces with ours. Until "done"
+        // arrives the revision is unknown, so an aborted turn resyncs.
+        synced = messages.size();
+        revision = UNKNOWN_REVISION;
+        do {
+            if (reply.contains("chunk") || reply.contains("thinking") || reply.contains("tool_call")) {
+                bool keep_going = true;
+                if (reply.contains("chunk")) {
+                    keep_going = !callback || callback(reply["chunk"].get<std::string>());
+                } else if (reply.contains("thinking")) {
+                    keep_going = !thinking_callback || thinking_callback(reply["thinking"].get<std::string>());
+                } else {
+                    keep_going = !tool_callback || tool_callback(reply["tool_call"].get<ToolCall>());
+                }
+                if (!keep_going) {
+                    // Dropping the connection makes the daemon abort the generation
+                    conn.reset();
+                    return "Error: aborted";
+                }
+            } else if (reply.value("done", false)) {
+                revision = reply.value("revision", UNKNOWN_REVISION);
+                return reply.value("response", "");
+            } else if (reply.contains("error")) {
+                return "Error: " + reply["error"].get<std::string>();
+            }
+        } while (conn->receive(reply, cancel_fd));
+        cancelled = conn->interrupted();
+        conn.reset();
+        return cancelled ? "Error: cancelled" : "Error: daemon connection lost";
+    }
+
+private:
+    DaemonClient(const std::string& session, bool temporary, const std::string& socket_path)
+        : session(session), temporary(temporary), socket_path(socket_path) {}
+
+    std::string session;
+    bool temporary;
+    std::string socket_path;
+    std::unique_ptr<LineSocket> conn;
+    std::vector<Message> attached_history;
+    static constexpr uint64_t UNKNOWN_REVISION = UINT64_MAX;
+    size_t synced = 0; // Leading messages of our history the daemon already has
+    uint64_t revision = 0; // Session revision those messages belong to
+    bool models_fetched = false;
+
+    json chat_request(const std::string& model, const std::vector<Message>& messages, bool think, const json& tools) {
+        if (synced > messages.size()) {
+            synced = 0;
+        }
+        json delta = json::array();
+        for (size_t i = synced; i < messages.size(); ++i) {
+            delta.push_back(messages[i]);
+        }
+        json req = {{"op", "chat"}, {"model", model}, {"think", think}, {"base", synced}, {"revision", revision}, {"messages", delta}};
+        if (tools.is_array() && !tools.empty()) {
+            req["tools"] = tools;
+        }
+        return req;
+    }
+
+    bool attach(json& reply) {
+        int fd = connect_unix_socket(socket_path);
+        if (fd == -1) {
+            return false;
+        }
+        conn = std::make_unique<LineSocket>(fd);
+        if (!conn->send({{"op", "hello"}, {"session", session}, {"temporary", temporary}}) || !conn->receive(reply)) {
+            conn.reset();
+            return false;
+        }
+        // After a reconnect the session may have moved on, or the daemon may
+        // have restarted and lost it
+        if (reply.value("revision", uint64_t(0)) != revision) {
+            synced = 0;
+        }
+        synced = std::min(synced, reply.value("history", json::array()).size());
+        return true;
+    }
+
+    // Sends one request and reads the first reply line, reattaching once if
+    // the previous connection was dropped. When `cancel` becomes readable
+    // first, the connection is dropped (which aborts a chat on the daemon)
+    // and `cancelled` is set.
+    bool request(const json& req, json& reply, int cancel = -1, bool* cancelled = nullptr) {
+        for (int attempt = 0; attempt < 2; ++attempt) {
+            if (!conn && !attach(reply)) {
+                return false;
+            }
+            if (conn->send(req) && conn->receive(reply, cancel)) {
+                return true;
+            }
+            bool interrupted = conn->interrupted();
+            conn.reset();
+            if (interrupted) {
+                if (cancelled) *cancelled = true;
+                return false;
+            }
+        }
+        return false;
+    }
+};
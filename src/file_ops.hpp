@@ -1,19 +1,208 @@
 #pragma once
 
 #include <string>
+#include <vector>
 #include <fstream>
+#include <sstream>
 #include <iostream>
+#include <cstdlib>
+#include <cerrno>
+#include <cstring>
+#include <climits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "patch.hpp"
 
 class FileOperations {
 public:
+    // Writes via a temporary file next to the target and rename(2), so the
+    // target is never left half-written. Symlinks are followed, and the owner,
+    // group and mode of a replaced file are kept; a file with other hard links,
+    // or whose owner we cannot reproduce, is rewritten in place instead.
     static bool write_file(const std::string& path, const std::string& content) {
-        std::ofstream outfile(path);
-        if (!outfile.is_open()) {
-            std::cerr << "Error: Could not open file for writing: " << path << std::endl;
+        std::string target = resolve_target(path);
+        struct stat st;
+        bool exists = stat(target.c_str(), &st) == 0;
+        if (exists && st.st_nlink > 1) {
+            return write_in_place(target, content);
+        }
+
+        size_t slash = target.find_last_of('/');
+        std::string dir = slash == std::string::npos ? "." : (slash == 0 ? "/" : target.substr(0, slash));
+        std::string name = slash == std::string::npos ? target : target.substr(slash + 1);
+        std::string tmp_path = dir + "/." + name + ".tmp.XXXXXX";
+
+        std::vector<char> tmp_template(tmp_path.begin(), tmp_path.end());
+        tmp_template.push_back('\0');
+        int fd = mkstemp(tmp_template.data());
+        if (fd == -1) {
+            if (exists) return write_in_place(target, content); // e.g. no write access to the directory
+            std::cerr << "Error: Could not open file for writing: " << path << " (" << strerror(errno) << ")" << std::endl;
             return false;
         }
-        outfile << content;
-        outfile.close();
+        tmp_path = tmp_template.data();
+
+        // New files get the usual 0666 & ~umask. fchown() comes first as it
+        // may clear the set-id bits.
+        if (exists) {
+            struct stat tmp_st;
+            bool same_owner = fstat(fd, &tmp_st) == 0 && tmp_st.st_uid == st.st_uid && tmp_st.st_gid == st.st_gid;
+            if (!same_owner && fchown(fd, st.st_uid, st.st_gid) != 0) {
+                close(fd);
+                unlink(tmp_path.c_str());
+                return write_in_place(target, content);
+            }
+            fchmod(fd, st.st_mode & 07777);
+        } else {
+            mode_t mask = umask(0);
+            umask(mask);
+            fchmod(fd, 0666 & ~mask);
+        }
+
+        bool ok = write_all(fd, content) && fsync(fd) == 0;
+        ok = close(fd) == 0 && ok;
+        if (!ok || rename(tmp_path.c_str(), target.c_str()) != 0) {
+            std::cerr << "Error: Could not write file: " << path << " (" << strerror(errno) << ")" << std::endl;
+            unlink(tmp_path.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    static bool read_file(const std::string& path, std::string& content) {
+        std::ifstream infile(path, std::ios::binary);
+        if (!infile.is_open()) {
+            return false;
+        }
+        std::stringstream ss;
+        ss << infile.rdbuf();
+        content = ss.str();
+        return true;
+    }
+
+    // Dry run of patch_file(): finds the line each hunk applies at without
+    // writing anything, so the confirmation can show where the change lands
+    static bool locate_patch(const std::string& path, const std::vector<PatchHunk>& hunks, std::vector<long>& located,
+                             std::string& error) {
+        std::string patched;
+        return apply_patch(path, hunks, patched, error, &located);
+    }
+
+    // Reads a file for the model's context: at most `max_bytes` of it, as
+    // valid UTF-8 (bad bytes become U+FFFD). Files with NUL bytes are
+    // refused as binary.
+    static bool read_text_file(const std::string& path, std::string& content, std::string& error, size_t max_bytes = 64 * 1024) {
+        std::ifstream infile(path, std::ios::binary);
+        if (!infile.is_open()) {
+            error = "could not open file";
+            return false;
+        }
+        std::string raw(max_bytes + 1, '\0');
+        infile.read(&raw[0], static_cast<std::streamsize>(raw.size()));
+        raw.resize(static_cast<size_t>(infile.gcount()));
+        if (raw.find('\0') != std::string::npos) {
+            error = "binary file";
+            return false;
+        }
+        bool truncated = raw.size() > max_bytes;
+        if (truncated) raw.resize(max_bytes);
+
+        content = valid_utf8(raw, truncated);
+        if (truncated) {
+            struct stat st;
+            std::string total = stat(path.c_str(), &st) == 0 ? " of " + std::to_string(st.st_size) : "";
+            content += "\n[... truncated: first " + std::to_string(max_bytes) + total + " bytes shown ...]\n";
+        }
         return true;
     }
+
+    // Applies parsed hunks to the file on disk and writes it back atomically.
+    // A missing file counts as empty, so a diff can create a new file.
+    static bool patch_file(const std::string& path, const std::vector<PatchHunk>& hunks, std::string& error) {
+        std::string patched;
+        if (!apply_patch(path, hunks, patched, error)) {
+            return false;
+        }
+        if (!write_file(path, patched)) {
+            error = "could not write file";
+            return false;
+        }
+        return true;
+    }
+
+private:
+    // The file a write to `path` ends up in. Symlinks are followed, also to a
+    // target that does not exist yet, so rename() replaces the file and not
+    // the link.
+    static std::string resolve_target(std::string path) {
+        for (int hops = 0; hops < 40; ++hops) {
+            if (char* real = realpath(path.c_str(), nullptr)) {
+                std::string resolved = real;
+                free(real);
+                return resolved;
+            }
+            char link[PATH_MAX];
+            ssize_t n = readlink(path.c_str(), link, sizeof(link) - 1);
+            if (n <= 0) break; // Not a dangling link: a new file
+            std::string next(link, n);
+            size_t slash = path.find_last_of('/');
+            path = next[0] == '/' || slash == std::string::npos ? next : path.substr(0, slash + 1) + next;
+        }
+        return path;
+    }
+
+    // `text` with each invalid UTF-8 sequence replaced by U+FFFD. With
+    // `cut`, an incomplete sequence at the end is dropped instead.
+    static std::string valid_utf8(const std::string& text, bool cut) {
+        std::string out;
+        out.reserve(text.size());
+        for (size_t i = 0; i < text.size();) {
+            unsigned char c = text[i];
+            size_t len = c < 0x80 ? 1 : (c >> 5) == 0x6 ? 2 : (c >> 4) == 0xe ? 3 : (c >> 3) == 0x1e ? 4 : 0;
+            size_t n = 1;
+            while (n < len && i + n < text.size() && (static_cast<unsigned char>(text[i + n]) & 0xc0) == 0x80) n++;
+            if (len > 0 && n == len) {
+                out.append(text, i, len);
+            } else if (!(cut && len > 0 && i + n == text.size())) {
+                out += "\xef\xbf\xbd";
+            }
+            i += std::max<size_t>(n, 1);
+        }
+        return out;
+    }
+
+    static bool write_all(int fd, const std::string& content) {
+        size_t written = 0;
+        while (written < content.size()) {
+            ssize_t n = ::write(fd, content.data() + written, content.size() - written);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            written += n;
+        }
+        return true;
+    }
+
+    // Keeps the inode, and with it hard links and ownership, at the cost of
+    // atomicity
+    static bool write_in_place(const std::string& path, const std::string& content) {
+        int fd = open(path.c_str(), O_WRONLY | O_TRUNC | O_CLOEXEC);
+        bool ok = fd != -1 && write_all(fd, content) && fsync(fd) == 0;
+        if (fd != -1) ok = close(fd) == 0 && ok;
+        if (!ok) {
+            std::cerr << "Error: Could not write file: " << path << " (" << strerror(errno) << ")" << std::endl;
+        }
+        return ok;
+    }
+
+    static bool apply_patch(const std::string& path, const std::vector<PatchHunk>& hunks, std::string& patched, std::string& error,
+                            std::vector<long>* located = nullptr) {
+        std::string original;
+        if (!read_file(path, original) && access(path.c_str(), F_OK) == 0) {
+            error = "could not read file";
+            return false;
+        }
+        return Patch::apply(original, hunks, patched, error, located);
+    }
 };
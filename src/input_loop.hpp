@@ -0,0 +1,389 @@
+#pragma once
+
+#include <string>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <algorithm>
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <readline/readline.h>
+#include <readline/history.h>
+
+#include "terminal_output.hpp"
+
+// Line input that keeps working while the model or a command runs.
+//
+// A background thread drives readline's callback interface from a poll loop,
+// so the next request can be typed, and queued, while a reply is streaming.
+// Finished lines wait in a queue until the main loop asks for them with
+// next(). Output goes through term_out() (std::cout and std::cerr are routed
+// there while the loop runs), which erases the prompt, writes whole lines
+// above it and redraws it together with the half-typed line.
+//
+// Commands that may read the terminal run inside a Pause, which gives stdin
+// and the cooked terminal modes back to them. While a question is open, a
+// readable cancel fd (see Interrupt) answers it with "q".
+class InputLoop : public TerminalOverlay {
+public:
+    InputLoop() : out_buf(term_out()), err_buf(term_out()) {}
+
+    ~InputLoop() {
+        stop();
+    }
+
+    InputLoop(const InputLoop&) = delete;
+    InputLoop& operator=(const InputLoop&) = delete;
+
+    void start() {
+        if (pipe(wake_fds) != 0) {
+            std::cerr << "Failed to create input wake pipe" << std::endl;
+            return;
+        }
+        for (int fd : wake_fds) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+        tty = isatty(STDIN_FILENO);
+        active = this;
+        rl_catch_signals = 0; // Ctrl-C belongs to Interrupt
+
+        std::cout << std::flush;
+        saved_out = std::cout.rdbuf(&out_buf);
+        if (isatty(STDERR_FILENO)) {
+            saved_err = std::cerr.rdbuf(&err_buf);
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            rl_callback_handler_install(display_prompt().c_str(), on_line);
+            installed = true;
+        }
+        if (isatty(STDOUT_FILENO)) {
+            term_out().set_overlay(this);
+        }
+        reader = std::thread(&InputLoop::run, this);
+    }
+
+    void stop() {
+        if (!reader.joinable()) return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            wake();
+        }
+        cv.notify_all();
+        reader.join();
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (installed) {
+                rl_clear_visible_line();
+                fflush(rl_outstream);
+                rl_callback_handler_remove();
+                installed = false;
+            }
+        }
+        term_out().set_overlay(nullptr);
+        term_out().flush();
+        std::cout.rdbuf(saved_out);
+        if (saved_err) std::cerr.rdbuf(saved_err);
+        close(wake_fds[0]);
+        close(wake_fds[1]);
+        active = nullptr;
+    }
+
+    // Set before start()
+    void set_cancel_fd(int fd) {
+        cancel_fd = fd;
+    }
+
+    void set_prompt(const std::string& text) {
+        std::lock_guard<std::mutex> lock(mutex);
+        prompt = text;
+        refresh_prompt();
+    }
+
+    // Next queued line; waits for one if the queue is empty. False at EOF.
+    bool next(std::string& line) {
+        std::unique_lock<std::mutex> lock(mutex);
+        waiting = true;
+        wake();
+        cv.wait(lock, [&] { return !queue.empty() || eof || stopping; });
+        waiting = false;
+        if (queue.empty()) return false;
+
+        line = std::move(queue.front());
+        queue.pop_front();
+        refresh_prompt();
+        return true;
+    }
+
+    // Asks a question with its own prompt; the next line typed answers it and
+    // is not queued. A half-typed line is put back afterwards.
+    bool ask(const std::string& question, std::string& answer) {
+        term_out().flush();
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!installed) return false;
+
+        draft.assign(rl_line_buffer, rl_end);
+        draft_point = rl_point;
+        rl_replace_line("", 1);
+        rl_point = 0;
+        question_prompt = question;
+        asking = true;
+        answered = false;
+        waiting = true;
+        wake();
+        refresh_prompt();
+
+        cv.wait(lock, [&] { return answered || stopping; });
+        waiting = false;
+        if (!answered) return false;
+        answered = false;
+        answer = std::move(reply);
+        return !eof;
+    }
+
+    // Drops queued lines, e.g. after the user cancelled the current turn
+    size_t discard_queued() {
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t count = queue.size();
+        queue.clear();
+        refresh_prompt();
+        return count;
+    }
+
+    // Hands the terminal to a command for the lifetime of the scope
+    class Pause {
+    public:
+        explicit Pause(InputLoop& loop) : loop(loop) {
+            loop.pause();
+        }
+
+        ~Pause() {
+            loop.resume();
+        }
+
+        Pause(const Pause&) = delete;
+        Pause& operator=(const Pause&) = delete;
+
+    private:
+        InputLoop& loop;
+    };
+
+    bool prompt_shown() const override {
+        return installed.load();
+    }
+
+    // Keeps the lock until end_output() so readline cannot redraw in between
+    bool begin_output() override {
+        mutex.lock();
+        if (!installed) {
+            mutex.unlock();
+            return false;
+        }
+        rl_clear_visible_line();
+        fflush(rl_outstream);
+        return true;
+    }
+
+    void end_output() override {
+        rl_forced_update_display();
+        fflush(rl_outstream);
+        mutex.unlock();
+    }
+
+private:
+    // readline's line handler takes no user data
+    static inline InputLoop* active = nullptr;
+
+    std::thread reader;
+    std::mutex mutex; // Guards readline and everything below
+    std::condition_variable cv;
+    int wake_fds[2] = {-1, -1};
+    int cancel_fd = -1;
+    bool tty = true;
+
+    std::atomic<bool> installed{false}; // Handler installed and prompt on screen
+    bool paused = false;
+    bool stopping = false;
+    bool eof = false;
+    bool waiting = false; // next() or ask() is blocked on input
+
+    std::string prompt;
+    std::deque<std::string> queue;
+
+    bool asking = false;
+    bool answered = false;
+    std::string question_prompt;
+    std::string reply;
+
+    // Half-typed line saved across questions and pauses
+    std::string draft;
+    int draft_point = 0;
+    bool restore_draft = false;
+
+    TerminalStreambuf out_buf;
+    TerminalStreambuf err_buf;
+    std::streambuf* saved_out = nullptr;
+    std::streambuf* saved_err = nullptr;
+
+    void wake() {
+        (void)!write(wake_fds[1], "x", 1);
+    }
+
+    std::string display_prompt() const {
+        if (asking) return question_prompt;
+        if (queue.empty()) return prompt;
+        return "[" + std::to_string(queue.size()) + " queued] " + prompt;
+    }
+
+    void refresh_prompt() {
+        if (!installed) return;
+        rl_clear_visible_line();
+        rl_set_prompt(display_prompt().c_str());
+        rl_forced_update_display();
+        fflush(rl_outstream);
+    }
+
+    void put_back_draft() {
+        if (draft.empty()) return;
+        rl_insert_text(draft.c_str());
+        rl_point = std::min(draft_point, rl_end);
+        rl_redisplay();
+        draft.clear();
+    }
+
+    void pause() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!installed) return;
+            draft.assign(rl_line_buffer, rl_end);
+            draft_point = rl_point;
+            rl_clear_visible_line();
+            fflush(rl_outstream);
+            rl_callback_handler_remove(); // Also restores the terminal modes
+            installed = false;
+            paused = true;
+            wake();
+        }
+        term_out().flush();
+    }
+
+    void resume() {
+        term_out().end_line();
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!paused) return;
+        paused = false;
+        if (eof || stopping) return;
+        rl_callback_handler_install(display_prompt().c_str(), on_line);
+        installed = true;
+        put_back_draft();
+        wake();
+    }
+
+    // Ctrl-C at a question: "no, and stop generating"
+    void cancel_question() {
+        rl_point = rl_end;
+        rl_redisplay();
+        fputs("^C\n", rl_outstream);
+        rl_replace_line("", 1);
+        rl_on_new_line();
+        asking = false;
+        answered = true;
+        reply = "q";
+        rl_set_prompt(display_prompt().c_str());
+        put_back_draft();
+        rl_redisplay();
+        fflush(rl_outstream);
+        cv.notify_all();
+    }
+
+    static void on_line(char* line) {
+        active->handle_line(line);
+    }
+
+    // Runs inside rl_callback_read_char(), with the lock held
+    void handle_line(char* line) {
+        if (!line) {
+            // Ctrl-D on an empty line
+            eof = true;
+            rl_callback_handler_remove();
+            installed = false;
+            if (asking) {
+                asking = false;
+                answered = true;
+            }
+            cv.notify_all();
+            return;
+        }
+
+        std::string text = line;
+        free(line);
+        if (!tty) waiting = false; // Read piped input one line per request
+
+        if (asking) {
+            asking = false;
+            answered = true;
+            reply = text;
+            restore_draft = true;
+        } else if (text.find_first_not_of(" \t") != std::string::npos) {
+            add_history(text.c_str());
+            queue.push_back(text);
+        }
+        // The prompt is redrawn when this handler returns
+        rl_set_prompt(display_prompt().c_str());
+        cv.notify_all();
+    }
+
+    void run() {
+        while (true) {
+            bool want_input;
+            bool want_cancel;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (stopping) return;
+                want_input = installed && (tty || waiting);
+                want_cancel = installed && asking;
+            }
+
+            // The cancel fd is only watched, never drained: the cancelled
+            // operation still has to see it
+            pollfd fds[3] = {{wake_fds[0], POLLIN, 0},
+                             {want_input ? STDIN_FILENO : -1, POLLIN, 0},
+                             {want_cancel ? cancel_fd : -1, POLLIN, 0}};
+            if (poll(fds, 3, -1) < 0) {
+                if (errno == EINTR) continue;
+                return;
+            }
+            if (fds[0].revents & POLLIN) {
+                char buf[64];
+                while (read(wake_fds[0], buf, sizeof(buf)) > 0) {
+                }
+            }
+            if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (installed && !stopping) {
+                    rl_callback_read_char();
+                    if (restore_draft && installed) {
+                        restore_draft = false;
+                        put_back_draft();
+                    }
+                }
+            }
+            if (fds[2].revents & POLLIN) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (installed && asking && !stopping) {
+                    cancel_question();
+                }
+            }
+        }
+    }
+};
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <atomic>
+#include <csignal>
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+
+// Ctrl-C handling.
+//
+// While an operation is armed (an Interrupt::Scope is alive), the first SIGINT
+// only marks it as cancelled and makes fd() readable. HttpClient, DaemonClient
+// and Shell poll that fd next to their own I/O, so they react within
+// milliseconds instead of waiting for the next chunk. A second SIGINT, or one
+// arriving while nothing is armed, exits the program; the terminal modes seen
+// at install() are restored first, since the line editor may have changed them.
+class Interrupt {
+public:
+    static void install() {
+        if (pipe(pipe_fds) == 0) {
+            for (int fd : pipe_fds) {
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                fcntl(fd, F_SETFD, FD_CLOEXEC);
+            }
+        }
+
+        struct sigaction sa{};
+        sa.sa_handler = handler;
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = 0; // No SA_RESTART: let blocking calls see EINTR
+        sigaction(SIGINT, &sa, nullptr);
+
+        have_termios = isatty(STDIN_FILENO) && tcgetattr(STDIN_FILENO, &saved_termios) == 0;
+    }
+
+    // Readable once the current operation has been cancelled
+    static int fd() {
+        return pipe_fds[0];
+    }
+
+    static bool requested() {
+        return cancelled.load();
+    }
+
+    // Arms cancellation for the duration of an operation. Nested scopes share
+    // the outermost one's state.
+    class Scope {
+    public:
+        Scope() {
+            depth++;
+        }
+
+        ~Scope() {
+            if (--depth == 0) {
+                reset();
+            }
+        }
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+    };
+
+private:
+    static inline int pipe_fds[2] = {-1, -1};
+    static inline std::atomic<int> depth{0};
+    static inline std::atomic<bool> cancelled{false};
+    static inline termios saved_termios{};
+    static inline bool have_termios = false;
+
+    static void handler(int) {
+        if (depth.load() == 0 || cancelled.load()) {
+            if (have_termios) tcsetattr(STDIN_FILENO, TCSANOW, &saved_termios);
+            const char msg[] = "\nBye!\n";
+            (void)!write(STDOUT_FILENO, msg, sizeof(msg) - 1);
+            _exit(130);
+        }
+        cancelled = true;
+        (void)!write(pipe_fds[1], "x", 1);
+    }
+
+    static void reset() {
+        char buf[64];
+        while (pipe_fds[0] >= 0 && read(pipe_fds[0], buf, sizeof(buf)) > 0) {
+        }
+        cancelled = false;
+    }
+};
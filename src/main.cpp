@@ -1,9 +1,10 @@
 #include <iostream>
 #include <string>
 #include <vector>
-#include <regex>
 #include <cstring>
 #include <cstdlib>
+#include <algorithm>
+#include <cerrno>
 #include <unistd.h>
 #include <limits.h>
 #include <readline/readline.h>
@@ -14,6 +15,11 @@
 #include "completion.hpp"
 #include "utils.hpp"
 #include "file_ops.hpp"
+#include "daemon.hpp"
+#include "terminal_output.hpp"
+#include "stream_parser.hpp"
+#include "interrupt.hpp"
+#include "input_loop.hpp"
 
 enum class Mode {
     Agent,
@@ -30,66 +36,237 @@ std::string trim(const std::string& str) {
     return str.substr(first, (last - first + 1));
 }
 
-int main() {
-    std::cout << "=== Terminal AI (C++ Version) ===" << std::endl;
-
-    // Initialize components
-    Ollama ollama;
-    Shell shell;
-    setup_readline();
-
-    // Fetch models
-    std::cout << "Fetching models..." << std::endl;
-    auto models = ollama.list_models();
-    if (models.empty()) {
-        std::cerr << "No models found or Ollama not running." << std::endl;
-        return 1;
-    }
-
-    // Simple model selection (default to first)
-    std::string selected_model = models[0];
-    std::cout << "Using model: " << selected_model << std::endl;
+// Shows how much terminal noise was kept out of the model's context
+void report_normalization(const OutputNormalizer& normalizer) {
+    if (normalizer.tokens_saved() == 0) return;
+    std::cout << ANSI::GRAY << "(Output for context: " << normalizer.input_bytes() << " -> "
+              << normalizer.output_bytes() << " bytes, ~" << normalizer.tokens_saved() << " tokens saved)"
+              << ANSI::RESET << std::endl;
+}
 
-    // System prompt
-    std::string system_prompt = R"(
+// System prompt; models without native reasoning are asked for <think> tags.
+// Models with native tool calling get the actions as typed tools (see
+// action_tools()) and skip the fenced-block conventions and their examples.
+std::string build_system_prompt(bool native_thinking, bool native_tools) {
+    std::string prompt = R"(
     You are a Linux Terminal Assistant running on Arch Linux (Fish Shell).
-    
-    [IMPORTANT RULES]
+    )";
+
+    if (!native_thinking) {
+        prompt += R"(
+    [REASONING]
     1. First, analyze the user's request and write your thinking process enclosed in <think> and </think> tags.
     2. YOU MUST CLOSE THE </think> TAG BEFORE WRITING YOUR FINAL RESPONSE.
     3. The content inside <think>...</think> is for your internal reasoning only. The user will not see it as the main answer.
     4. After </think>, write the actual response to the user.
-    5. If the user asks to perform a system action, output the command inside a code block labeled 'execute'.
-    6. To WRITE a file, use a code block labeled 'write:filename'.
-    7. To READ a file, use 'cat filename' inside an 'execute' block.
-    8. NEVER use the 'execute' or 'write' tags for examples or explanations. Only use them when you intend to trigger an actual action.
-    9. If you want to show an example of code creation, just use a normal code block without the 'write:' prefix.
-    10. You MUST answer in Korean.
-    11. When searching for a specific file, use the 'find' command (e.g., 'find . -name "filename"').
-    12. When you need to understand the project structure or look for files without a specific name, use 'ls -R' or 'cd' to explore.
+    )";
+    }
+
+    if (native_tools) {
+        prompt += R"(
+    [IMPORTANT RULES]
+    1. Use the provided tools to run commands and to read, write or patch files. Call a tool only when you intend to perform the action.
+    2. To change part of an existing file, use 'patch' instead of rewriting the whole file with 'write'.
+    3. You MUST answer in Korean.
+    4. When searching for a specific file, use the 'find' command (e.g., 'find . -name "filename"').
+    5. When you need to understand the project structure or look for files without a specific name, use 'ls -R' to explore.
+    )";
+        return prompt;
+    }
+
+    prompt += R"(
+    [IMPORTANT RULES]
+    1. If the user asks to perform a system action, output the command inside a code block labeled 'execute'.
+    2. To WRITE a new file, use a code block labeled 'write:filename'.
+    3. To CHANGE part of an existing file, use a code block labeled 'patch:filename' containing a unified diff or SEARCH/REPLACE blocks. Include only the changed lines plus a few lines of context; never rewrite a whole file to change a few lines.
+    4. To READ a file, use 'cat filename' inside an 'execute' block.
+    5. NEVER use the 'execute', 'write' or 'patch' tags for examples or explanations. Only use them when you intend to trigger an actual action.
+    6. If you want to show an example of code creation, just use a normal code block without the 'write:' prefix.
+    7. You MUST answer in Korean.
+    8. When searching for a specific file, use the 'find' command (e.g., 'find . -name "filename"').
+    9. When you need to understand the project structure or look for files without a specific name, use 'ls -R' or 'cd' to explore.
 
     Example (Write):
-    <think>User wants to create main.py.</think>
     I will create the file for you.
     ```write:main.py
     print("Hello World")
     ```
 
+    Example (Patch):
+    I will change the greeting.
+    ```patch:main.py
+    <<<<<<< SEARCH
+    print("Hello World")
+    =======
+    print("Hello, Arch!")
+    >>>>>>> REPLACE
+    ```
+
     Example (Read):
-    <think>User wants to read main.py.</think>
     I will read the file.
     ```execute
     cat main.py
     ```
     )";
+    return prompt;
+}
+
+// The actions as /api/chat tool definitions
+json action_tools() {
+    auto tool = [](const std::string& name, const std::string& description, const json& properties) {
+        json required = json::array();
+        for (const auto& property : properties.items()) {
+            required.push_back(property.key());
+        }
+        return json{{"type", "function"},
+                    {"function", {{"name", name},
+                                  {"description", description},
+                                  {"parameters", {{"type", "object"}, {"properties", properties}, {"required", required}}}}}};
+    };
+    auto text = [](const std::string& description) {
+        return json{{"type", "string"}, {"description", description}};
+    };
+
+    return json::array({
+        tool("execute", "Run a shell command on the user's machine and return its output",
+             {{"command", text("Command line to run")}}),
+        tool("read", "Read a text file",
+             {{"path", text("Path of the file")}}),
+        tool("write", "Create a file, or replace all of its content",
+             {{"path", text("Path of the file")}, {"content", text("Complete content of the file")}}),
+        tool("patch", "Change part of an existing file",
+             {{"path", text("Path of the file")},
+              {"patch", text("Unified diff hunks, or SEARCH/REPLACE blocks ('<<<<<<< SEARCH', old lines, '=======', "
+                             "new lines, '>>>>>>> REPLACE'). Include only the changed lines plus a few lines of context.")}}),
+    });
+}
+
+struct ModelFeatures {
+    bool thinking = false; // Native reasoning ("think" option)
+    bool tools = false;    // Native tool calling
+};
+
+ModelFeatures model_features(ChatBackend& backend, const std::string& model) {
+    auto caps = backend.capabilities(model);
+    auto has = [&](const std::string& capability) {
+        return std::find(caps.begin(), caps.end(), capability) != caps.end();
+    };
+    return {has("thinking"), has("tools")};
+}
+
+enum class ActionChoice {
+    Run,
+    Skip,
+    RunAndStop,
+    SkipAndStop
+};
+
+// Asks whether to perform an action proposed mid-stream, optionally stopping
+// the rest of the generation
+ActionChoice ask_action(InputLoop& input_loop, const std::string& question) {
+    std::string prompt = question + " (y/n, s = yes and stop generating, q = no and stop generating) ";
+    std::string confirm;
+    ActionChoice choice = ActionChoice::Skip;
+    if (input_loop.ask(prompt, confirm)) {
+        std::string answer = trim(confirm);
+        if (answer == "y" || answer == "Y") {
+            choice = ActionChoice::Run;
+        } else if (answer == "s" || answer == "S") {
+            choice = ActionChoice::RunAndStop;
+        } else if (answer == "q" || answer == "Q") {
+            choice = ActionChoice::SkipAndStop;
+        }
+    }
+    return choice;
+}
+
+int main(int argc, char** argv) {
+    bool run_daemon = false;
+    bool use_daemon = true;
+    std::string session_name = "pid-" + std::to_string(getpid());
+    bool named_session = false;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--daemon") {
+            run_daemon = true;
+        } else if (arg == "--no-daemon") {
+            use_daemon = false;
+        } else if (arg == "--session" && i + 1 < argc) {
+            session_name = argv[++i];
+            named_session = true;
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--daemon | --no-daemon | --session NAME]" << std::endl;
+            return 1;
+        }
+    }
+
+    if (run_daemon) {
+        std::cout << "=== Terminal AI Daemon ===" << std::endl;
+        DaemonServer server;
+        return server.run();
+    }
+
+    std::cout << "=== Terminal AI (C++ Version) ===" << std::endl;
+
+    // Initialize components: attach to the resident daemon if one is running,
+    // otherwise talk to Ollama directly
+    std::unique_ptr<ChatBackend> backend;
+    DaemonClient* daemon = nullptr;
+    if (use_daemon) {
+        auto client = DaemonClient::connect(session_name, !named_session);
+        if (client) {
+            daemon = client.get();
+            backend = std::move(client);
+            std::cout << "Attached to daemon (session: " << session_name << ")" << std::endl;
+            command_candidates = daemon->executables();
+        }
+    }
+    if (!backend) {
+        backend = std::make_unique<Ollama>();
+    }
+    ChatBackend& ollama = *backend;
+    Shell shell;
+    setup_readline();
+
+    // First Ctrl-C cancels the running generation or command, a second one exits
+    Interrupt::install();
+    ollama.set_cancel_fd(Interrupt::fd());
+    shell.set_cancel_fd(Interrupt::fd());
+
+    // Fetch models
+    std::cout << "Fetching models..." << std::endl;
+    auto models = ollama.list_models();
+    if (models.empty()) {
+        std::cerr << "No models found or Ollama not running." << std::endl;
+        return 1;
+    }
+
+    // Simple model selection (default to first)
+    std::string selected_model = models[0];
+    std::cout << "Using model: " << selected_model << std::endl;
+
+    ModelFeatures features = model_features(ollama, selected_model);
+    const json tools = action_tools();
 
     std::vector<Message> history;
-    history.push_back({"system", system_prompt});
+    if (daemon && !daemon->history().empty()) {
+        // Resume the conversation of the attached session
+        history = daemon->history();
+        std::cout << "Resumed session with " << history.size() - 1 << " message(s)." << std::endl;
+        if (history.front().role == "system") {
+            history.front().content = build_system_prompt(features.thinking, features.tools);
+        }
+    } else {
+        history.push_back({"system", build_system_prompt(features.thinking, features.tools)});
+    }
 
     Mode current_mode = Mode::Agent;
-    std::regex re_think(R"(<think>([\s\S]*?)</think>)");
-    std::regex re_execute(R"(```execute\s*([\s\S]*?)\s*```)");
-    std::regex re_write(R"(```write:([^\s`]+)\s*([\s\S]*?)\s*```)");
+
+    // Input is read on a background thread from here on, so the next request
+    // can be typed while this loop is busy
+    InputLoop input_loop;
+    input_loop.set_cancel_fd(Interrupt::fd());
+    input_loop.start();
 
     bool auto_continue = false;
     while (true) {
@@ -103,23 +280,18 @@ int main() {
         std::string cwd_str(cwd);
 
         if (current_mode == Mode::Agent) {
-            prompt = "\n(Agent) >>> ";
+            prompt = "(Agent) >>> ";
         } else {
-            prompt = "\n(Shell:" + cwd_str + ") $ ";
+            prompt = "(Shell:" + cwd_str + ") $ ";
         }
 
-        char* input_cstr = readline(prompt.c_str());
-        if (!input_cstr) {
+        std::cout << std::endl;
+        input_loop.set_prompt(prompt);
+        if (!input_loop.next(input)) {
             std::cout << "\nBye!" << std::endl;
             break;
         }
 
-        input = input_cstr;
-        if (!input.empty()) {
-            add_history(input_cstr);
-        }
-        free(input_cstr);
-
         input = trim(input);
         if (input.empty()) continue;
 
@@ -136,6 +308,14 @@ int main() {
             current_mode = Mode::Agent;
             std::cout << "Switched to Agent Mode." << std::endl;
             continue;
+        } else if (input.rfind("!export ", 0) == 0) {
+            // Full transcript, including the reasoning kept out of requests
+            std::string path = trim(input.substr(8));
+            json transcript = history;
+            if (FileOperations::write_file(path, transcript.dump(2, ' ', false, json::error_handler_t::replace))) {
+                std::cout << "Session exported to " << path << std::endl;
+            }
+            continue;
         } else if (input == "!model") {
             std::cout << "Fetching models..." << std::endl;
             auto current_models = ollama.list_models();
@@ -149,16 +329,19 @@ int main() {
                 std::cout << i + 1 << ". " << current_models[i] << std::endl;
             }
             
-            char* selection = readline("Select model (number): ");
-            if (selection) {
-                int idx = atoi(selection);
+            std::string selection;
+            if (input_loop.ask("Select model (number): ", selection)) {
+                int idx = atoi(selection.c_str());
                 if (idx > 0 && idx <= (int)current_models.size()) {
                     selected_model = current_models[idx - 1];
                     std::cout << "Switched to model: " << selected_model << std::endl;
+                    features = model_features(ollama, selected_model);
+                    if (!history.empty() && history.front().role == "system") {
+                        history.front().content = build_system_prompt(features.thinking, features.tools);
+                    }
                 } else {
                     std::cout << "Invalid selection." << std::endl;
                 }
-                free(selection);
             }
             continue;
         }
@@ -178,13 +361,20 @@ int main() {
 
                 if (!path.empty()) {
                     if (chdir(path.c_str()) != 0) {
-                        perror("cd failed");
+                        std::cerr << "cd failed: " << strerror(errno) << std::endl;
                     }
                 }
                 continue;
             }
 
-            std::string output = shell.execute(input);
+            std::string output;
+            OutputNormalizer normalizer;
+            {
+                InputLoop::Pause paused(input_loop);
+                Interrupt::Scope interruptible;
+                output = shell.execute(input, &normalizer);
+            }
+            report_normalization(normalizer);
             // Add to history for AI context
             history.push_back({"user", "Executed Shell Command: " + input + "\nOutput:\n" + output});
         } else {
@@ -196,144 +386,250 @@ int main() {
             }
             std::cout << "Thinking..." << std::flush;
             
-            // Streaming state
+            // Streaming state; the answer and the reasoning are kept apart so
+            // only the answer is sent back to the model on later turns
             bool is_thinking = false;
-            std::string full_response;
+            bool stop_generation = false;
+            std::string answer;
+            std::string thinking;
+            // Results of actions dispatched mid-stream; they belong after the
+            // assistant message in history
+            std::vector<Message> action_results;
+            // Native tool calls of this reply, and the one being handled
+            std::vector<ToolCall> tool_calls;
+            std::string action_tool;
+            auto add_result = [&](const std::string& text) {
+                if (action_tool.empty()) {
+                    action_results.push_back({"user", text});
+                } else {
+                    action_results.push_back({"tool", text, "", {}, action_tool});
+                }
+            };
             
-            // Clear "Thinking..." line before streaming starts
-            std::cout << "\r\033[K"; 
-
-            auto stream_callback = [&](const std::string& chunk) -> bool {
-                full_response += chunk;
-                
-                // Simple state machine for coloring <think> blocks
-                // Note: This is a basic implementation. For perfect handling of split tags, 
-                // a more robust parser would be needed, but this suffices for typical token-by-token output.
-                
-                std::string display_chunk = chunk;
-                
-                // Check for <think> start
-                size_t think_start = display_chunk.find("<think>");
-                if (think_start != std::string::npos) {
-                    is_thinking = true;
-                    // Print part before <think>
-                    std::cout << display_chunk.substr(0, think_start);
-                    std::cout << ANSI::GRAY << ANSI::ITALIC << "🧠 Thinking Process:\n" << ANSI::GRAY;
-                    // Print part after <think>
-                    std::cout << display_chunk.substr(think_start + 7);
-                    return true; 
+            // "Thinking..." stays up until the model produces something
+            bool placeholder_shown = true;
+            auto clear_placeholder = [&] {
+                if (placeholder_shown) {
+                    term_out() << "\r\033[K";
+                    placeholder_shown = false;
                 }
-                
-                // Check for </think> end
-                size_t think_end = display_chunk.find("</think>");
-                if (think_end != std::string::npos) {
-                    is_thinking = false;
-                    // Print part before </think>
-                    std::cout << display_chunk.substr(0, think_end);
-                    std::cout << ANSI::RESET << "\n" << ANSI::GRAY << "----------------------------------------" << ANSI::RESET << "\n";
-                    // Print part after </think>
-                    std::cout << display_chunk.substr(think_end + 8);
-                    return true;
+            };
+
+            // Actions are confirmed as soon as their block closes, while the
+            // model keeps generating; the user may also stop generation there.
+            auto on_event = [&](const StreamEvent& event) {
+                if (stop_generation) return;
+
+                // With native tools, fenced blocks in the text are only examples
+                bool is_action = event.type == StreamEvent::Type::Execute || event.type == StreamEvent::Type::Write ||
+                                 event.type == StreamEvent::Type::Patch;
+                if (is_action && features.tools && action_tool.empty()) return;
+
+                switch (event.type) {
+                    case StreamEvent::Type::Text:
+                        (is_thinking ? thinking : answer) += event.text;
+                        // Coalesced by the terminal writer instead of flushing per token
+                        term_out() << (is_thinking ? ANSI::GRAY + event.text : event.text);
+                        break;
+
+                    case StreamEvent::Type::ThinkStart:
+                        is_thinking = true;
+                        term_out() << ANSI::GRAY + ANSI::ITALIC + "🧠 Thinking Process:\n" + ANSI::GRAY;
+                        break;
+
+                    case StreamEvent::Type::ThinkEnd:
+                        is_thinking = false;
+                        term_out() << ANSI::RESET + "\n" + ANSI::GRAY + "----------------------------------------" + ANSI::RESET + "\n";
+                        break;
+
+                    case StreamEvent::Type::Execute: {
+                        std::string command = trim(event.text);
+                        term_out().flush();
+                        std::cout << "\n[!] AI wants to execute:\n" << ANSI::YELLOW << command << ANSI::RESET << std::endl;
+
+                        ActionChoice choice = ask_action(input_loop, "Execute?");
+                        stop_generation = choice == ActionChoice::RunAndStop || choice == ActionChoice::SkipAndStop;
+                        if (choice == ActionChoice::Run || choice == ActionChoice::RunAndStop) {
+                            std::cout << "Running..." << std::endl;
+                            OutputNormalizer normalizer;
+                            std::string output;
+                            {
+                                InputLoop::Pause paused(input_loop);
+                                output = shell.execute(command, &normalizer);
+                            }
+                            report_normalization(normalizer);
+                            add_result("System Output: " + output);
+                            auto_continue = true;
+                        } else {
+                            std::cout << "Cancelled." << std::endl;
+                            add_result("User cancelled execution.");
+                        }
+                        break;
+                    }
+
+                    case StreamEvent::Type::Write: {
+                        std::string filename = trim(event.filename);
+                        std::string content = event.text;
+                        // Trim leading/trailing newline of a fenced block if present
+                        if (action_tool.empty() && !content.empty() && content.front() == '\n') content.erase(0, 1);
+                        if (action_tool.empty() && !content.empty() && content.back() == '\n') content.pop_back();
+
+                        term_out().flush();
+                        std::cout << "\n[!] AI wants to WRITE to file: " << ANSI::CYAN << filename << ANSI::RESET << std::endl;
+                        std::cout << "Content preview:\n" << ANSI::GRAY << content.substr(0, 100) << (content.length() > 100 ? "..." : "") << ANSI::RESET << std::endl;
+
+                        ActionChoice choice = ask_action(input_loop, "Write file?");
+                        stop_generation = choice == ActionChoice::RunAndStop || choice == ActionChoice::SkipAndStop;
+                        if (choice == ActionChoice::Run || choice == ActionChoice::RunAndStop) {
+                            if (FileOperations::write_file(filename, content)) {
+                                std::cout << "File written successfully." << std::endl;
+                                add_result("System: File " + filename + " written successfully.");
+                                auto_continue = true;
+                            } else {
+                                std::cout << "Failed to write file." << std::endl;
+                                add_result("System: Failed to write file " + filename);
+                            }
+                        } else {
+                            std::cout << "Cancelled." << std::endl;
+                            add_result("User cancelled file write.");
+                        }
+                        break;
+                    }
+
+                    case StreamEvent::Type::Patch: {
+                        std::string filename = trim(event.filename);
+                        std::vector<PatchHunk> hunks;
+                        std::string error;
+
+                        term_out().flush();
+                        if (!Patch::parse(event.text, hunks, error)) {
+                            std::cout << "\n[!] AI sent an invalid patch for " << filename << ": " << error << std::endl;
+                            add_result("System: Invalid patch for " + filename + ": " + error);
+                            break;
+                        }
+                        std::vector<long> located;
+                        if (!FileOperations::locate_patch(filename, hunks, located, error)) {
+                            std::cout << "\n[!] AI sent a patch that does not apply to " << filename << ": " << error << std::endl;
+                            add_result("System: Failed to patch file " + filename + ": " + error);
+                            break;
+                        }
+                        std::cout << "\n[!] AI wants to PATCH file: " << ANSI::CYAN << filename << ANSI::RESET << std::endl;
+                        std::cout << Patch::preview(hunks, located);
+
+                        ActionChoice choice = ask_action(input_loop, "Apply patch?");
+                        stop_generation = choice == ActionChoice::RunAndStop || choice == ActionChoice::SkipAndStop;
+                        if (choice == ActionChoice::Run || choice == ActionChoice::RunAndStop) {
+                            if (FileOperations::patch_file(filename, hunks, error)) {
+                                std::cout << "Patch applied successfully." << std::endl;
+                                add_result("System: File " + filename + " patched successfully.");
+                                auto_continue = true;
+                            } else {
+                                std::cout << "Failed to apply patch: " << error << std::endl;
+                                add_result("System: Failed to patch file " + filename + ": " + error);
+                            }
+                        } else {
+                            std::cout << "Cancelled." << std::endl;
+                            add_result("User cancelled file patch.");
+                        }
+                        break;
+                    }
                 }
-                
-                if (is_thinking) {
-                    std::cout << ANSI::GRAY << display_chunk;
+            };
+            ActionStreamParser parser(on_event);
+
+            // Native tool calls go through the same confirmations
+            auto tool_callback = [&](const ToolCall& call) -> bool {
+                if (stop_generation) return false;
+                clear_placeholder();
+                tool_calls.push_back(call);
+                action_tool = call.name;
+                std::string path = call.argument("path");
+                if (call.name == "execute") {
+                    on_event({StreamEvent::Type::Execute, call.argument("command")});
+                } else if (call.name == "write") {
+                    on_event({StreamEvent::Type::Write, call.argument("content"), path});
+                } else if (call.name == "patch") {
+                    on_event({StreamEvent::Type::Patch, call.argument("patch"), path});
+                } else if (call.name == "read") {
+                    term_out().flush();
+                    std::cout << "\n[!] AI wants to READ file: " << ANSI::CYAN << path << ANSI::RESET << std::endl;
+
+                    ActionChoice choice = ask_action(input_loop, "Read file?");
+                    stop_generation = choice == ActionChoice::RunAndStop || choice == ActionChoice::SkipAndStop;
+                    std::string content;
+                    std::string error;
+                    if (choice == ActionChoice::Run || choice == ActionChoice::RunAndStop) {
+                        if (FileOperations::read_text_file(path, content, error)) {
+                            std::cout << "File read (" << content.size() << " bytes)." << std::endl;
+                            add_result(content);
+                            auto_continue = true;
+                        } else {
+                            std::cout << "Failed to read file: " << error << std::endl;
+                            add_result("System: Failed to read file " + path + ": " + error);
+                        }
+                    } else {
+                        std::cout << "Cancelled." << std::endl;
+                        add_result("User cancelled file read.");
+                    }
                 } else {
-                    std::cout << display_chunk;
+                    add_result("System: Unknown tool " + call.name);
                 }
-                std::cout << std::flush;
-                
-                return true;
+                action_tool.clear();
+                return !stop_generation && !Interrupt::requested();
+            };
+
+            auto stream_callback = [&](const std::string& chunk) -> bool {
+                clear_placeholder();
+                parser.feed(chunk);
+                return !stop_generation && !Interrupt::requested();
+            };
+            auto thinking_callback = [&](const std::string& chunk) -> bool {
+                clear_placeholder();
+                parser.feed_thinking(chunk);
+                return !stop_generation && !Interrupt::requested();
             };
 
-            std::string response = ollama.chat(selected_model, history, stream_callback);
+            std::string response;
+            bool cancelled;
+            {
+                Interrupt::Scope interruptible;
+                response = ollama.chat(selected_model, history, stream_callback,
+                                       features.thinking ? StreamCallback(thinking_callback) : nullptr,
+                                       features.tools ? tools : json::array(), tool_callback);
+                cancelled = Interrupt::requested();
+            }
+            clear_placeholder();
+            parser.finish();
+            term_out().flush();
             
-            // If response was built via streaming, use full_response. 
-            // However, ollama.chat returns the full text anyway in our implementation.
-            // But let's ensure we have the final clean output for history.
-            if (response.empty() && !full_response.empty()) {
-                response = full_response;
+            // The streamed text is authoritative (it is also all we have when
+            // generation was stopped or cancelled early); the return value only
+            // matters when nothing was streamed, e.g. an error message.
+            if (answer.empty() && thinking.empty() && tool_calls.empty() && !cancelled) {
+                answer = response;
+                std::cout << answer;
             }
             
             // Add a newline at the end if not present
-            if (!response.empty() && response.back() != '\n') {
+            if (!answer.empty() && answer.back() != '\n') {
                 std::cout << std::endl;
             }
-
-            // Parse <think> for history storage
-            std::smatch match;
-            std::string final_answer = response;
-            if (std::regex_search(response, match, re_think)) {
-                // We already displayed the thought process. 
-                // Just remove it for the "final_answer" variable if needed for other logic.
-                final_answer = std::regex_replace(response, re_think, "");
-            }
-            
-            // We already printed the output via stream, so we don't need to print it again using MarkdownRenderer.
-            // However, the stream output didn't use MarkdownRenderer for the non-thinking part (it just printed raw chunks).
-            // If we want nice markdown (colors for code blocks), we might want to re-print?
-            // But that would duplicate the output.
-            // Ideally, the stream callback should handle markdown rendering.
-            // For now, let's accept that streaming might be raw text, or we can clear screen and reprint?
-            // No, clearing screen is bad UX for long outputs.
-            // Let's just keep the raw stream output for now, as requested "real-time".
-            // The user asked for "process", so raw text is acceptable.
-            // But wait, the original code used MarkdownRenderer.
-            // If we want to support markdown in stream, we need a streaming markdown parser.
-            // That's complex. 
-            // Alternative: After streaming is done, we could re-render the *final answer* part?
-            // But that would duplicate.
-            // Let's stick to raw output for now, but maybe we can apply basic coloring in the callback if possible.
-            // For this task, let's just ensure we don't double print.
-            
-            // std::cout << MarkdownRenderer::render(trim(final_answer)) << std::endl; // REMOVED to avoid double print
-            history.push_back({"assistant", response});
-
-            // Parse execute block
-            if (std::regex_search(response, match, re_execute)) {
-                std::string command = trim(match[1].str());
-                std::cout << "\n[!] AI wants to execute:\n" << ANSI::YELLOW << command << ANSI::RESET << std::endl;
-                
-                char* confirm = readline("Execute? (y/n) ");
-                if (confirm && (strcmp(confirm, "y") == 0 || strcmp(confirm, "Y") == 0)) {
-                    std::cout << "Running..." << std::endl;
-                    std::string output = shell.execute(command);
-                    history.push_back({"user", "System Output: " + output});
-                    auto_continue = true;
-                } else {
-                    std::cout << "Cancelled." << std::endl;
-                    history.push_back({"user", "User cancelled execution."});
+            if (cancelled) {
+                std::cout << ANSI::GRAY << "(Generation cancelled.)" << ANSI::RESET << std::endl;
+                // Ctrl-C stops the whole batch, not just the current turn
+                size_t discarded = input_loop.discard_queued();
+                if (discarded > 0) {
+                    std::cout << ANSI::GRAY << "(" << discarded << " queued input(s) discarded.)" << ANSI::RESET << std::endl;
                 }
-                if (confirm) free(confirm);
+            } else if (stop_generation) {
+                std::cout << ANSI::GRAY << "(Generation stopped.)" << ANSI::RESET << std::endl;
             }
 
-            // Parse write block
-            if (std::regex_search(response, match, re_write)) {
-                std::string filename = trim(match[1].str());
-                std::string content = match[2].str();
-                // Trim leading/trailing newline from content if present
-                if (!content.empty() && content.front() == '\n') content.erase(0, 1);
-                if (!content.empty() && content.back() == '\n') content.pop_back();
-
-                std::cout << "\n[!] AI wants to WRITE to file: " << ANSI::CYAN << filename << ANSI::RESET << std::endl;
-                std::cout << "Content preview:\n" << ANSI::GRAY << content.substr(0, 100) << (content.length() > 100 ? "..." : "") << ANSI::RESET << std::endl;
-                
-                char* confirm = readline("Write file? (y/n) ");
-                if (confirm && (strcmp(confirm, "y") == 0 || strcmp(confirm, "Y") == 0)) {
-                    if (FileOperations::write_file(filename, content)) {
-                        std::cout << "File written successfully." << std::endl;
-                        history.push_back({"user", "System: File " + filename + " written successfully."});
-                        auto_continue = true;
-                    } else {
-                        std::cout << "Failed to write file." << std::endl;
-                        history.push_back({"user", "System: Failed to write file " + filename});
-                    }
-                } else {
-                    std::cout << "Cancelled." << std::endl;
-                    history.push_back({"user", "User cancelled file write."});
-                }
-                if (confirm) free(confirm);
+            // Partial replies of cancelled generations are kept as context
+            if (!answer.empty() || !thinking.empty() || !tool_calls.empty()) {
+                history.push_back({"assistant", trim(answer), trim(thinking), tool_calls});
             }
+            history.insert(history.end(), action_results.begin(), action_results.end());
         }
     }
 
@@ -7,6 +7,10 @@
 #include <nlohmann/json.hpp>
 
 #include <functional>
+#include <sstream>
+#include <string_view>
+#include <algorithm>
+#include <cstring>
 using json = nlohmann::json;
 
 // Callback type for streaming: returns true to continue, false to abort
@@ -16,30 +20,67 @@ class HttpClient {
 public:
     HttpClient() {
         curl = curl_easy_init();
+        multi = curl_multi_init();
     }
 
     ~HttpClient() {
+        if (multi) {
+            curl_multi_cleanup(multi);
+        }
         if (curl) {
             curl_easy_cleanup(curl);
         }
     }
 
     struct Response {
-        long status_code;
+        long status_code = 0;
         std::string body;
         std::string error;
     };
 
-    Response get(const std::string& url) {
-        return request(url, "", "GET");
+    Response get(const std::string& url, int cancel_fd = -1) {
+        return request(url, {}, "GET", nullptr, cancel_fd);
+    }
+
+    // `cancel_fd`, when readable, aborts the transfer (see Interrupt)
+    Response post(const std::string& url, const std::string& data, StreamCallback callback = nullptr, int cancel_fd = -1) {
+        return request(url, {data}, "POST", callback, cancel_fd);
     }
 
-    Response post(const std::string& url, const std::string& data, StreamCallback callback = nullptr) {
-        return request(url, data, "POST", callback);
+    // Posts the concatenation of `parts` without joining them first; curl
+    // reads straight from the caller's buffers, which must outlive the call
+    Response post(const std::string& url, const std::vector<std::string_view>& parts, StreamCallback callback = nullptr, int cancel_fd = -1) {
+        return request(url, parts, "POST", callback, cancel_fd);
     }
 
 private:
     CURL* curl;
+    CURLM* multi; // Drives `curl` so the transfer can also wait on a cancel fd
+
+    // Read position within a request body made of several parts
+    struct BodyReader {
+        const std::vector<std::string_view>* parts;
+        size_t part = 0;
+        size_t offset = 0;
+    };
+
+    static size_t ReadCallback(char* buffer, size_t size, size_t nitems, void* userp) {
+        auto* reader = static_cast<BodyReader*>(userp);
+        size_t capacity = size * nitems;
+        size_t copied = 0;
+        while (copied < capacity && reader->part < reader->parts->size()) {
+            std::string_view part = (*reader->parts)[reader->part];
+            size_t n = std::min(capacity - copied, part.size() - reader->offset);
+            memcpy(buffer + copied, part.data() + reader->offset, n);
+            copied += n;
+            reader->offset += n;
+            if (reader->offset == part.size()) {
+                reader->part++;
+                reader->offset = 0;
+            }
+        }
+        return copied;
+    }
 
     static size_t WriteCallback(void* contents, size_t size, size_t nmemb, void* userp) {
         size_t totalSize = size * nmemb;
@@ -58,9 +99,9 @@ private:
         return totalSize;
     }
 
-    Response request(const std::string& url, const std::string& data, const std::string& method, StreamCallback callback = nullptr) {
+    Response request(const std::string& url, const std::vector<std::string_view>& body, const std::string& method, StreamCallback callback = nullptr, int cancel_fd = -1) {
         Response response;
-        if (!curl) {
+        if (!curl || !multi) {
             response.error = "CURL init failed";
             return response;
         }
@@ -74,16 +115,24 @@ private:
 
         struct curl_slist* headers = NULL;
         headers = curl_slist_append(headers, "Content-Type: application/json");
+        headers = curl_slist_append(headers, "Expect:"); // No 100-continue round trip for large bodies
         curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
 
+        BodyReader reader{&body};
         if (method == "POST") {
+            curl_off_t body_size = 0;
+            for (const auto& part : body) {
+                body_size += part.size();
+            }
             curl_easy_setopt(curl, CURLOPT_POST, 1L);
-            curl_easy_setopt(curl, CURLOPT_POSTFIELDS, data.c_str());
+            curl_easy_setopt(curl, CURLOPT_READFUNCTION, ReadCallback);
+            curl_easy_setopt(curl, CURLOPT_READDATA, &reader);
+            curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, body_size);
         } else {
             curl_easy_setopt(curl, CURLOPT_POST, 0L);
         }
 
-        CURLcode res = curl_easy_perform(curl);
+        CURLcode res = perform(cancel_fd);
         if (res != CURLE_OK) {
             response.error = curl_easy_strerror(res);
         } else {
@@ -97,22 +146,153 @@ private:
         
         return response;
     }
+
+    // Equivalent of curl_easy_perform that also returns CURLE_ABORTED_BY_CALLBACK
+    // as soon as `cancel_fd` becomes readable
+    CURLcode perform(int cancel_fd) {
+        curl_multi_add_handle(multi, curl);
+
+        CURLcode result = CURLE_OK;
+        bool cancelled = false;
+        int running = 1;
+        while (running) {
+            if (curl_multi_perform(multi, &running) != CURLM_OK || !running) {
+                break;
+            }
+            curl_waitfd extra{};
+            extra.fd = cancel_fd;
+            extra.events = CURL_WAIT_POLLIN;
+            curl_multi_poll(multi, cancel_fd >= 0 ? &extra : nullptr, cancel_fd >= 0 ? 1 : 0, 1000, nullptr);
+            if (extra.revents & CURL_WAIT_POLLIN) {
+                cancelled = true;
+                break;
+            }
+        }
+
+        if (cancelled) {
+            result = CURLE_ABORTED_BY_CALLBACK;
+        } else {
+            int remaining;
+            while (CURLMsg* msg = curl_multi_info_read(multi, &remaining)) {
+                if (msg->msg == CURLMSG_DONE) {
+                    result = msg->data.result;
+                }
+            }
+        }
+
+        // Removing an unfinished transfer closes its connection, which tells
+        // the server to stop generating
+        curl_multi_remove_handle(multi, curl);
+        return result;
+    }
 };
 
 struct ModelInfo {
     std::string name;
 };
 
+// A native tool call from the model (/api/chat "tools")
+struct ToolCall {
+    std::string name;
+    json arguments = json::object();
+
+    // String argument; other JSON values are returned serialized
+    std::string argument(const std::string& key) const {
+        auto it = arguments.find(key);
+        if (it == arguments.end() || it->is_null()) return "";
+        return it->is_string() ? it->get<std::string>() : it->dump();
+    }
+};
+
+// Same shape as Ollama's message.tool_calls entries
+inline void to_json(json& j, const ToolCall& call) {
+    j = json{{"function", {{"name", call.name}, {"arguments", call.arguments}}}};
+}
+
+inline void from_json(const json& j, ToolCall& call) {
+    const json& function = j.contains("function") ? j["function"] : j;
+    call.name = function.value("name", "");
+    call.arguments = function.value("arguments", json::object());
+    if (call.arguments.is_string()) {
+        // Some servers pass the arguments as a JSON-encoded string
+        call.arguments = json::parse(call.arguments.get<std::string>(), nullptr, false);
+    }
+    if (!call.arguments.is_object()) {
+        call.arguments = json::object();
+    }
+}
+
+// Called for each tool call as it arrives; returns true to continue
+using ToolCallback = std::function<bool(const ToolCall&)>;
+
 struct Message {
     std::string role;
     std::string content;
+    std::string thinking; // Reasoning behind an assistant reply; never sent back to the model
+    std::vector<ToolCall> tool_calls; // Native tool calls made by an assistant reply
+    std::string tool_name; // Tool whose result a "tool" message carries
+};
+
+// What the model gets to see of a message
+inline json request_json(const Message& msg) {
+    json j = {{"role", msg.role}, {"content", msg.content}};
+    if (!msg.tool_calls.empty()) {
+        j["tool_calls"] = msg.tool_calls;
+    }
+    if (!msg.tool_name.empty()) {
+        j["tool_name"] = msg.tool_name;
+    }
+    return j;
+}
+
+// Full record, used for the daemon protocol and exports
+inline void to_json(json& j, const Message& msg) {
+    j = request_json(msg);
+    if (!msg.thinking.empty()) {
+        j["thinking"] = msg.thinking;
+    }
+}
+
+inline void from_json(const json& j, Message& msg) {
+    msg.role = j.value("role", "");
+    msg.content = j.value("content", "");
+    msg.thinking = j.value("thinking", "");
+    msg.tool_calls = j.value("tool_calls", std::vector<ToolCall>{});
+    msg.tool_name = j.value("tool_name", "");
+}
+
+// Common interface for talking to a model: either directly (Ollama) or through
+// the resident daemon (DaemonClient in daemon.hpp).
+class ChatBackend {
+public:
+    virtual ~ChatBackend() = default;
+
+    virtual std::vector<std::string> list_models() = 0;
+
+    // Capabilities reported by /api/show, e.g. "completion", "thinking", "tools"
+    virtual std::vector<std::string> capabilities(const std::string& model) = 0;
+
+    // With a `thinking_callback`, the model's native reasoning (Ollama's
+    // "think" option) is streamed to it separately from the answer.
+    // `tools` is an array of /api/chat tool definitions; the model's calls are
+    // passed to `tool_callback`.
+    virtual std::string chat(const std::string& model, const std::vector<Message>& messages, StreamCallback callback = nullptr, StreamCallback thinking_callback = nullptr,
+                             const json& tools = json::array(), ToolCallback tool_callback = nullptr) = 0;
+
+    // Requests are aborted as soon as `fd` becomes readable (-1 disables)
+    void set_cancel_fd(int fd) {
+        cancel_fd = fd;
+    }
+
+protected:
+    int cancel_fd = -1;
 };
 
-class Ollama {
+class Ollama : public ChatBackend {
 public:
     Ollama(const std::string& base_url = "http://localhost:11434") : base_url(base_url) {}
 
-    std::vector<std::string> list_models() {
+    std::vector<std::string> list_models() override {
         auto res = client.get(base_url + "/api/tags");
         std::vector<std::string> models;
         if (res.status_code == 200) {
@@ -130,16 +310,43 @@ public:
         return models;
     }
 
-    std::string chat(const std::string& model, const std::vector<Message>& messages, StreamCallback callback = nullptr) {
+    std::vector<std::string> capabilities(const std::string& model) override {
+        auto res = client.post(base_url + "/api/show", json{{"model", model}}.dump());
+        std::vector<std::string> caps;
+        if (res.status_code == 200) {
+            try {
+                caps = json::parse(res.body).value("capabilities", std::vector<std::string>{});
+            } catch (const std::exception& e) {
+                std::cerr << "JSON Parse Error: " << e.what() << std::endl;
+            }
+        }
+        return caps;
+    }
+
+    // Loads `model` into memory ahead of its first chat; an /api/chat request
+    // without messages does only that. It stays loaded for the server's keep_alive.
+    bool load(const std::string& model) {
+        auto res = client.post(base_url + "/api/chat", json{{"model", model}, {"messages", json::array()}}.dump());
+        return res.status_code == 200;
+    }
+
+    std::string chat(const std::string& model, const std::vector<Message>& messages, StreamCallback callback = nullptr, StreamCallback thinking_callback = nullptr,
+                     const json& tools = json::array(), ToolCallback tool_callback = nullptr) override {
         json j;
         j["model"] = model;
         j["stream"] = (callback != nullptr);
-        
-        json msgs = json::array();
-        for (const auto& msg : messages) {
-            msgs.push_back({{"role", msg.role}, {"content", msg.content}});
+        if (thinking_callback) {
+            j["think"] = true;
+        }
+        if (tools.is_array() && !tools.empty()) {
+            j["tools"] = tools;
         }
-        j["messages"] = msgs;
+
+        // Body = {"model":...,"stream":...,"messages":[ + cached array + ]}
+        sync_serialized_messages(messages);
+        std::string head = j.dump();
+        head.pop_back();
+        head += head.size() > 1 ? ",\"messages\":[" : "\"messages\":[";
 
         // Buffer to handle partial JSON chunks
         std::string buffer;
@@ -157,9 +364,17 @@ public:
                 
                 try {
                     auto j = json::parse(line);
-                    if (j.contains("message") && j["message"].contains("content")) {
-                        std::string content = j["message"]["content"];
-                        if (!callback(content)) return false;
+                    if (j.contains("message")) {
+                        const auto& message = j["message"];
+                        std::string thinking = message.value("thinking", "");
+                        if (!thinking.empty() && thinking_callback && !thinking_callback(thinking)) return false;
+                        std::string content = message.value("content", "");
+                        if (!content.empty() && !callback(content)) return false;
+                        if (message.contains("tool_calls") && tool_callback) {
+                            for (const auto& call : message["tool_calls"]) {
+                                if (!tool_callback(call.get<ToolCall>())) return false;
+                            }
+                        }
                     }
                     if (j.contains("done") && j["done"].get<bool>()) {
                         return true;
@@ -175,7 +390,7 @@ public:
         if (callback) {
             requestCallback = wrappedCallback;
         }
-        auto res = client.post(base_url + "/api/chat", j.dump(), requestCallback);
+        auto res = client.post(base_url + "/api/chat", {head, serialized_messages, "]}"}, requestCallback, cancel_fd);
         
         if (res.status_code == 200) {
             if (callback) {
@@ -207,6 +422,13 @@ public:
                     return "JSON Parse Error: " + std::string(e.what());
                 }
             }
+        } else if (res.error.empty()) {
+            // HTTP error, e.g. "think" requested from a model without thinking support
+            try {
+                return "Error: " + json::parse(res.body).value("error", "HTTP " + std::to_string(res.status_code));
+            } catch (...) {
+                return "Error: HTTP " + std::to_string(res.status_code);
+            }
         }
         return "Error: " + res.error;
     }
@@ -214,4 +436,48 @@ public:
 private:
     std::string base_url;
     HttpClient client;
+
+    // The "messages" array as sent last time, without brackets. History
+    // mostly grows between turns, so each turn escapes just the messages after
+    // the longest unchanged prefix instead of re-serializing the whole
+    // conversation.
+    std::string serialized_messages;
+    std::vector<size_t> serialized_hashes; // Per message, to find that prefix
+    std::vector<size_t> serialized_ends;   // End offset of each message's JSON
+
+    // Covers every field request_json() sends
+    static size_t fingerprint(const Message& msg) {
+        std::hash<std::string> hash;
+        size_t h = hash(msg.role);
+        h = h * 31 + hash(msg.content);
+        h = h * 31 + hash(msg.tool_name);
+        for (const auto& call : msg.tool_calls) {
+            h = h * 31 + hash(call.name);
+            h = h * 31 + hash(call.arguments.dump(-1, ' ', false, json::error_handler_t::replace));
+        }
+        return h;
+    }
+
+    void sync_serialized_messages(const std::vector<Message>& messages) {
+        // Another session, a changed system prompt or a rewritten message
+        // (e.g. a daemon session replaced by another client's history) only
+        // keeps what still matches
+        size_t keep = 0;
+        while (keep < serialized_hashes.size() && keep < messages.size() &&
+               fingerprint(messages[keep]) == serialized_hashes[keep]) {
+            keep++;
+        }
+        serialized_hashes.resize(keep);
+        serialized_ends.resize(keep);
+        serialized_messages.resize(keep > 0 ? serialized_ends.back() : 0);
+
+        // Reasoning stays local
+        for (size_t i = keep; i < messages.size(); ++i) {
+            if (i > 0) serialized_messages += ',';
+            // Command output may hold invalid UTF-8; replace it rather than throw
+            serialized_messages += request_json(messages[i]).dump(-1, ' ', false, json::error_handler_t::replace);
+            serialized_hashes.push_back(fingerprint(messages[i]));
+            serialized_ends.push_back(serialized_messages.size());
+        }
+    }
 };
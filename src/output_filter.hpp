@@ -0,0 +1,282 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cctype>
+#include <algorithm>
+
+// Streaming cleanup of command output before it enters the model's history.
+//
+// Terminal output is full of bytes that cost prompt-eval time but carry no
+// information for the model:
+//   - ANSI escape sequences (colors, cursor movement, OSC titles) are dropped;
+//     "erase to end of line" is honoured so redrawn lines come out right
+//   - carriage-return redraws (progress bars) keep only the final state of
+//     the line, the way a terminal would show it
+//   - runs of identical lines are folded to the first line plus a count
+//   - runs of lines that differ only in their numbers ("Downloading 41%",
+//     "Downloading 42%", ...) are folded to the first and last line plus a
+//     count, but only when they were redrawn in place or the run is long;
+//     shorter runs such as grep -n hits or compiler errors keep every line
+//
+// Input can be fed in arbitrary chunks; escape sequences and lines may be
+// split across them.
+class OutputNormalizer {
+public:
+    void feed(const char* data, size_t len) {
+        bytes_in += len;
+        for (size_t i = 0; i < len; ++i) {
+            consume(data[i]);
+        }
+    }
+
+    void feed(const std::string& data) {
+        feed(data.data(), data.size());
+    }
+
+    // Flushes the last (unterminated) line and returns the normalized text
+    std::string finish() {
+        if (!utf8_char.empty()) {
+            put(utf8_char);
+            utf8_char.clear();
+        }
+        if (!line.empty()) {
+            end_line(false);
+        }
+        close_run();
+        bytes_out = output.size();
+        return std::move(output);
+    }
+
+    size_t input_bytes() const {
+        return bytes_in;
+    }
+
+    size_t output_bytes() const {
+        return bytes_out;
+    }
+
+    // Rough estimate at ~4 bytes per token
+    size_t tokens_saved() const {
+        return bytes_in > bytes_out ? (bytes_in - bytes_out) / 4 : 0;
+    }
+
+private:
+    enum class EscState {
+        None,
+        Esc,    // After ESC
+        Csi,    // ESC [ ... final byte
+        Osc,    // ESC ] ... BEL or ESC \ (ST)
+        OscEsc  // ESC inside an OSC
+    };
+
+    EscState esc = EscState::None;
+    std::string csi_params;
+
+    std::string line;  // Current line as it would appear on screen
+    size_t cursor = 0; // Byte offset within `line`, always at a character boundary
+    std::string utf8_char; // Multi-byte character still being received
+    size_t utf8_length = 0;
+
+    bool line_redrawn = false; // Part of `line` was overwritten or erased
+
+    // Current run of lines with the same shape
+    static constexpr size_t LONG_RUN = 20; // Lines before any same-shape run folds
+    std::string run_shape;
+    std::string run_last;
+    size_t run_length = 0;
+    bool run_identical = true;
+    bool run_redrawn = true;
+    std::vector<std::string> run_held; // Lines after the first, until the run may fold
+
+    std::string output;
+    size_t bytes_in = 0;
+    size_t bytes_out = 0;
+
+    void consume(char c) {
+        switch (esc) {
+            case EscState::Esc:
+                if (c == '[') {
+                    esc = EscState::Csi;
+                    csi_params.clear();
+                } else if (c == ']') {
+                    esc = EscState::Osc;
+                } else {
+                    esc = EscState::None; // Two-byte sequence, e.g. ESC ( B
+                }
+                return;
+            case EscState::Csi:
+                if (c >= 0x40 && c <= 0x7e) {
+                    esc = EscState::None;
+                    apply_csi(c);
+                } else {
+                    csi_params += c;
+                }
+                return;
+            case EscState::Osc:
+                if (c == '\a') esc = EscState::None;
+                else if (c == '\033') esc = EscState::OscEsc;
+                return;
+            case EscState::OscEsc:
+                esc = c == '\\' ? EscState::None : EscState::Osc;
+                return;
+            case EscState::None:
+                break;
+        }
+
+        // Characters move the cursor as a whole, so a redraw never leaves
+        // half of a multi-byte sequence behind
+        unsigned char byte = static_cast<unsigned char>(c);
+        if (!utf8_char.empty() && (byte & 0xc0) == 0x80) {
+            utf8_char += c;
+            if (utf8_char.size() == utf8_length) {
+                put(utf8_char);
+                utf8_char.clear();
+            }
+            return;
+        }
+        if (!utf8_char.empty()) {
+            put(utf8_char); // Truncated sequence; kept as is
+            utf8_char.clear();
+        }
+        if (byte >= 0xc0 && byte < 0xf8) {
+            utf8_char = c;
+            utf8_length = byte >= 0xf0 ? 4 : byte >= 0xe0 ? 3 : 2;
+            return;
+        }
+
+        switch (c) {
+            case '\033': esc = EscState::Esc; break;
+            case '\r': cursor = 0; break;
+            case '\b': step_back(); break;
+            case '\n': end_line(true); break;
+            case '\t': put(std::string(1, c)); break;
+            default:
+                // Drop the remaining C0 controls (bell, shift-in/out, ...)
+                if (byte >= 0x20 && c != 0x7f) {
+                    put(std::string(1, c));
+                }
+                break;
+        }
+    }
+
+    static bool is_continuation(char c) {
+        return (static_cast<unsigned char>(c) & 0xc0) == 0x80;
+    }
+
+    // Writes one character at the cursor, replacing the character under it
+    void put(const std::string& ch) {
+        if (cursor < line.size()) {
+            line_redrawn = true;
+            size_t end = cursor + 1;
+            while (end < line.size() && is_continuation(line[end])) end++;
+            line.replace(cursor, end - cursor, ch);
+        } else {
+            line += ch;
+        }
+        cursor += ch.size();
+    }
+
+    void step_back() {
+        if (cursor == 0) return;
+        cursor--;
+        while (cursor > 0 && is_continuation(line[cursor])) cursor--;
+    }
+
+    // Numeric CSI parameter, e.g. the 3 in ESC [ 3 D
+    size_t csi_count(size_t fallback) const {
+        size_t n = 0;
+        for (char c : csi_params) {
+            if (!isdigit(static_cast<unsigned char>(c)) || n > 100000) break;
+            n = n * 10 + (c - '0');
+        }
+        return csi_params.empty() ? fallback : n;
+    }
+
+    void apply_csi(char final_byte) {
+        // Only erase-in-line and horizontal cursor moves change what ends up on the line
+        if (final_byte == 'K') {
+            if (csi_params.empty() || csi_params == "0") {
+                line_redrawn = line_redrawn || cursor < line.size();
+                line.resize(std::min(cursor, line.size()));
+            } else if (csi_params == "2") {
+                line_redrawn = line_redrawn || !line.empty();
+                line.clear();
+            }
+        } else if (final_byte == 'D') {
+            for (size_t n = csi_count(1); n > 0 && cursor > 0; --n) step_back();
+        } else if (final_byte == 'G') {
+            // Columns count characters; past the end of the line is the end
+            size_t column = csi_count(1);
+            cursor = 0;
+            for (size_t n = 1; n < column && cursor < line.size(); ++n) {
+                cursor++;
+                while (cursor < line.size() && is_continuation(line[cursor])) cursor++;
+            }
+        }
+    }
+
+    // Lines that differ only in digits share a shape
+    static std::string shape_of(const std::string& text) {
+        std::string shape;
+        shape.reserve(text.size());
+        for (char c : text) {
+            if (isdigit(static_cast<unsigned char>(c))) {
+                if (shape.empty() || shape.back() != '#') shape += '#';
+            } else {
+                shape += c;
+            }
+        }
+        return shape;
+    }
+
+    void end_line(bool newline) {
+        // Trailing blanks left over from overwritten progress output
+        size_t end = line.find_last_not_of(' ');
+        line.resize(end == std::string::npos ? 0 : end + 1);
+
+        std::string shape = shape_of(line);
+        if (run_length > 0 && shape == run_shape) {
+            run_identical = run_identical && line == run_last;
+            run_redrawn = run_redrawn && line_redrawn;
+            run_last = line;
+            run_length++;
+            if (run_length < LONG_RUN) {
+                run_held.push_back(line);
+            } else {
+                run_held.clear();
+            }
+        } else {
+            close_run();
+            output += line;
+            if (newline) output += '\n';
+            run_shape = std::move(shape);
+            run_last = line;
+            run_length = 1;
+            run_identical = true;
+            run_redrawn = line_redrawn;
+        }
+        line.clear();
+        cursor = 0;
+        line_redrawn = false;
+    }
+
+    // The first line of a run is already written; summarize the rest
+    void close_run() {
+        bool foldable = run_identical || run_redrawn || run_length >= LONG_RUN;
+        if (!foldable) {
+            for (const auto& held : run_held) {
+                output += held + "\n";
+            }
+        } else if (run_length == 2) {
+            output += run_last + "\n";
+        } else if (run_length > 2 && run_identical) {
+            output += "[previous line repeated " + std::to_string(run_length - 1) + " more times]\n";
+        } else if (run_length > 2) {
+            output += "[... " + std::to_string(run_length - 2) + " similar lines omitted ...]\n" + run_last + "\n";
+        }
+        run_length = 0;
+        run_held.clear();
+    }
+};
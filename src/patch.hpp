@@ -0,0 +1,349 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <cstdlib>
+#include <cctype>
+#include <algorithm>
+
+#include "utils.hpp"
+
+// One replacement: the lines expected in the file and what replaces them
+struct PatchHunk {
+    std::vector<std::string> before;
+    std::vector<std::string> after;
+    long hint_line = -1; // Old start line from a unified diff header, if any (0 = before line 1)
+    bool search_replace = false; // From a SEARCH/REPLACE block, which has no context to trim
+};
+
+// Partial file edits proposed by the model in a ```patch:filename block.
+//
+// Two formats are accepted, and may not be mixed within one block:
+//   - unified diff hunks (@@ -a,b +c,d @@ followed by ' ', '-' and '+' lines;
+//     the numbers are optional, ---/+++ headers are ignored)
+//   - search/replace blocks:
+//       <<<<<<< SEARCH
+//       old lines
+//       =======
+//       new lines
+//       >>>>>>> REPLACE
+//
+// Matching is loose like patch(1): a hunk may be found away from its line
+// hint and with different trailing whitespace or indentation. Unified diff
+// hunks may also drop up to two lines of surrounding context that no longer
+// match (fuzz). A hunk that matches more than one place is rejected unless its
+// line hint points exactly at one of them.
+class Patch {
+public:
+    static bool parse(const std::string& text, std::vector<PatchHunk>& hunks, std::string& error) {
+        hunks.clear();
+        std::vector<std::string> lines = split_lines(text);
+        bool search_replace = false;
+        for (const auto& line : lines) {
+            if (line.rfind("<<<<<<< SEARCH", 0) == 0) {
+                search_replace = true;
+                break;
+            }
+        }
+        bool ok = search_replace ? parse_search_replace(lines, hunks, error) : parse_unified(lines, hunks, error);
+        if (ok && hunks.empty()) {
+            error = "no hunks found";
+            ok = false;
+        }
+        for (size_t h = 0; ok && h < hunks.size(); ++h) {
+            if (hunks[h].before == hunks[h].after) {
+                error = "hunk " + std::to_string(h + 1) + " changes nothing";
+                ok = false;
+            }
+        }
+        return ok;
+    }
+
+    // Applies `hunks` in order to `original`; on failure `error` names the hunk.
+    // `located`, if given, receives the 1-based line in `original` each hunk
+    // starts at.
+    static bool apply(const std::string& original, const std::vector<PatchHunk>& hunks, std::string& result, std::string& error,
+                      std::vector<long>* located = nullptr) {
+        std::vector<std::string> lines = split_lines(original);
+        bool trailing_newline = original.empty() || original.back() == '\n';
+
+        long delta = 0;   // Line shift caused by the hunks applied so far
+        size_t last = 0;  // End of the previous hunk
+        if (located) located->clear();
+        for (size_t h = 0; h < hunks.size(); ++h) {
+            PatchHunk hunk = hunks[h];
+            size_t expected = hunk.hint_line > 0 ? static_cast<size_t>(std::max(0L, hunk.hint_line - 1 + delta)) : last;
+
+            long pos = -1;
+            size_t dropped = 0;  // Leading context lines trimmed by fuzz
+            size_t matches = 0;
+            if (hunk.before.empty()) {
+                // Pure insertion: only a line hint can place it. "@@ -N,0" means
+                // after old line N.
+                size_t after_line = hunk.hint_line >= 0 ? static_cast<size_t>(std::max(0L, hunk.hint_line + delta)) : lines.size();
+                pos = static_cast<long>(std::min(after_line, lines.size()));
+            } else {
+                pos = locate(lines, hunk, expected, last, dropped, matches);
+            }
+            if (pos < 0) {
+                std::string hunk_name = "hunk " + std::to_string(h + 1);
+                if (matches > 1) {
+                    error = hunk_name + " matches " + std::to_string(matches) + " places in the file (\"" + hunk.before.front() +
+                            "\"); include more surrounding lines to make it unique";
+                } else {
+                    error = hunk_name + " does not match the file (expected to find: \"" + hunk.before.front() + "\")";
+                }
+                return false;
+            }
+            if (located) located->push_back(pos - static_cast<long>(dropped) - delta + 1);
+
+            // Context lines keep the file's own text when matched loosely
+            size_t prefix = common_prefix(hunk);
+            size_t suffix = common_suffix(hunk, prefix);
+            for (size_t i = 0; i < prefix; ++i) {
+                hunk.after[i] = lines[pos + i];
+            }
+            for (size_t i = 1; i <= suffix; ++i) {
+                hunk.after[hunk.after.size() - i] = lines[pos + hunk.before.size() - i];
+            }
+
+            lines.erase(lines.begin() + pos, lines.begin() + pos + hunk.before.size());
+            lines.insert(lines.begin() + pos, hunk.after.begin(), hunk.after.end());
+            delta += static_cast<long>(hunk.after.size()) - static_cast<long>(hunk.before.size());
+            last = pos + hunk.after.size();
+        }
+
+        result.clear();
+        for (size_t i = 0; i < lines.size(); ++i) {
+            result += lines[i];
+            if (i + 1 < lines.size() || trailing_newline) result += '\n';
+        }
+        return true;
+    }
+
+    // Colored view of just the changed hunks, for the confirmation prompt.
+    // `located` are the lines apply() found the hunks at; without them the
+    // diff's own line hints are shown.
+    static std::string preview(const std::vector<PatchHunk>& hunks, const std::vector<long>& located = {}) {
+        std::string out;
+        for (size_t h = 0; h < hunks.size(); ++h) {
+            const auto& hunk = hunks[h];
+            out += ANSI::CYAN + "@@ hunk " + std::to_string(h + 1);
+            if (h < located.size()) {
+                out += " (line " + std::to_string(located[h]) + ")";
+            } else if (hunk.hint_line > 0) {
+                out += " (line " + std::to_string(hunk.hint_line) + ")";
+            }
+            out += " @@" + ANSI::RESET + "\n";
+
+            // Show shared leading/trailing lines as context, the rest as -/+
+            size_t prefix = common_prefix(hunk);
+            size_t suffix = common_suffix(hunk, prefix);
+            for (size_t i = 0; i < prefix; ++i) {
+                out += ANSI::GRAY + "  " + hunk.before[i] + ANSI::RESET + "\n";
+            }
+            for (size_t i = prefix; i < hunk.before.size() - suffix; ++i) {
+                out += ANSI::RED + "- " + hunk.before[i] + ANSI::RESET + "\n";
+            }
+            for (size_t i = prefix; i < hunk.after.size() - suffix; ++i) {
+                out += ANSI::GREEN + "+ " + hunk.after[i] + ANSI::RESET + "\n";
+            }
+            for (size_t i = hunk.before.size() - suffix; i < hunk.before.size(); ++i) {
+                out += ANSI::GRAY + "  " + hunk.before[i] + ANSI::RESET + "\n";
+            }
+        }
+        return out;
+    }
+
+private:
+    static std::vector<std::string> split_lines(const std::string& text) {
+        std::vector<std::string> lines;
+        std::stringstream ss(text);
+        std::string line;
+        while (std::getline(ss, line)) {
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            lines.push_back(line);
+        }
+        return lines;
+    }
+
+    static bool parse_search_replace(const std::vector<std::string>& lines, std::vector<PatchHunk>& hunks, std::string& error) {
+        enum class Part { Outside, Search, Replace } part = Part::Outside;
+        for (const auto& line : lines) {
+            if (line.rfind("<<<<<<< SEARCH", 0) == 0) {
+                hunks.emplace_back();
+                hunks.back().search_replace = true;
+                part = Part::Search;
+            } else if (part == Part::Search && line.rfind("=======", 0) == 0) {
+                part = Part::Replace;
+            } else if (part == Part::Replace && line.rfind(">>>>>>> REPLACE", 0) == 0) {
+                part = Part::Outside;
+            } else if (part == Part::Search) {
+                hunks.back().before.push_back(line);
+            } else if (part == Part::Replace) {
+                hunks.back().after.push_back(line);
+            }
+        }
+        if (part != Part::Outside) {
+            error = "unterminated SEARCH/REPLACE block";
+            return false;
+        }
+        for (const auto& hunk : hunks) {
+            if (hunk.before.empty()) {
+                error = "empty SEARCH section";
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // "-12,5" or "+12": start line and line count (1 when omitted)
+    static bool parse_range(const std::string& line, char sign, long& start, long& count) {
+        size_t at = line.find(sign, 2);
+        if (at == std::string::npos || at + 1 >= line.size() || !isdigit(static_cast<unsigned char>(line[at + 1]))) return false;
+        char* end = nullptr;
+        start = std::strtol(line.c_str() + at + 1, &end, 10);
+        count = *end == ',' ? std::strtol(end + 1, nullptr, 10) : 1;
+        return true;
+    }
+
+    static bool parse_unified(const std::vector<std::string>& lines, std::vector<PatchHunk>& hunks, std::string& error) {
+        bool in_hunk = false;
+        long old_left = -1; // Lines the header says are still to come; -1 if
+        long new_left = -1; // it gave no counts
+        for (size_t n = 0; n < lines.size(); ++n) {
+            const std::string& line = lines[n];
+            if (line.rfind("@@", 0) == 0) {
+                hunks.emplace_back();
+                in_hunk = true;
+                // "@@ -12,5 +12,6 @@": the old start line is a placement hint
+                long start = 0;
+                long new_start = 0;
+                bool has_old = parse_range(line, '-', start, old_left);
+                if (has_old) hunks.back().hint_line = start;
+                if (!has_old || !parse_range(line, '+', new_start, new_left)) old_left = new_left = -1;
+                continue;
+            }
+            if (!in_hunk) {
+                continue; // diff/index/---/+++ headers or prose
+            }
+            // Inside a hunk whose counts are not used up, "--- x" is a removed
+            // "-- x" line, not the next file's header
+            bool counts_left = old_left > 0 || new_left > 0;
+            bool file_header = !counts_left &&
+                               (line.rfind("diff ", 0) == 0 ||
+                                (line.rfind("--- ", 0) == 0 && n + 1 < lines.size() && lines[n + 1].rfind("+++ ", 0) == 0));
+            if (file_header) {
+                in_hunk = false; // Next file; keep scanning for hunks
+                continue;
+            }
+            if (!line.empty() && line[0] == '-') {
+                old_left--;
+            } else if (!line.empty() && line[0] == '+') {
+                new_left--;
+            } else if (line.empty() || line[0] != '\\') {
+                old_left--;
+                new_left--;
+            }
+            if (line.empty()) {
+                // Models often drop the leading space of blank context lines
+                hunks.back().before.push_back("");
+                hunks.back().after.push_back("");
+            } else if (line[0] == '-') {
+                hunks.back().before.push_back(line.substr(1));
+            } else if (line[0] == '+') {
+                hunks.back().after.push_back(line.substr(1));
+            } else if (line[0] == '\\') {
+                continue; // "\ No newline at end of file"
+            } else {
+                std::string context = line[0] == ' ' ? line.substr(1) : line;
+                hunks.back().before.push_back(context);
+                hunks.back().after.push_back(context);
+            }
+        }
+        if (hunks.empty()) {
+            error = "expected unified diff hunks (@@ ... @@) or SEARCH/REPLACE blocks";
+            return false;
+        }
+        return true;
+    }
+
+    static size_t common_prefix(const PatchHunk& hunk) {
+        size_t n = 0;
+        while (n < hunk.before.size() && n < hunk.after.size() && hunk.before[n] == hunk.after[n]) n++;
+        return n;
+    }
+
+    static size_t common_suffix(const PatchHunk& hunk, size_t prefix) {
+        size_t n = 0;
+        while (n < hunk.before.size() - prefix && n < hunk.after.size() - prefix &&
+               hunk.before[hunk.before.size() - 1 - n] == hunk.after[hunk.after.size() - 1 - n]) n++;
+        return n;
+    }
+
+    static std::string strip(const std::string& s, bool leading) {
+        size_t end = s.find_last_not_of(" \t");
+        if (end == std::string::npos) return "";
+        size_t start = leading ? s.find_first_not_of(" \t") : 0;
+        return s.substr(start, end - start + 1);
+    }
+
+    // Level 0: exact, 1: ignoring trailing whitespace, 2: ignoring indentation too
+    static bool lines_match(const std::string& a, const std::string& b, int level) {
+        if (level == 0) return a == b;
+        return strip(a, level == 2) == strip(b, level == 2);
+    }
+
+    // Finds the hunk's `before` lines, loosening the comparison step by step and
+    // preferring the match closest to `expected` that does not overlap the
+    // previous hunk. May trim unmatched context from a unified diff hunk (fuzz),
+    // reporting how many leading lines went in `dropped`. Returns -1 when
+    // nothing matches, or when the first level that matches finds `matches` > 1
+    // places and the line hint does not single one out.
+    static long locate(const std::vector<std::string>& lines, PatchHunk& hunk, size_t expected, size_t last,
+                       size_t& dropped, size_t& matches) {
+        size_t context_before = common_prefix(hunk);
+        size_t context_after = common_suffix(hunk, context_before);
+        size_t max_fuzz = hunk.search_replace ? 0 : 2;
+
+        for (size_t fuzz = 0; fuzz <= max_fuzz; ++fuzz) {
+            size_t drop_front = std::min(fuzz, context_before);
+            size_t drop_back = std::min(fuzz, context_after);
+            if (fuzz > 0 && drop_front == 0 && drop_back == 0) break;
+            if (drop_front + drop_back >= hunk.before.size()) break;
+
+            std::vector<std::string> needle(hunk.before.begin() + drop_front, hunk.before.end() - drop_back);
+            size_t target = expected + drop_front;
+            for (int level = 0; level <= 2; ++level) {
+                long best = -1;
+                size_t best_score = 0;
+                matches = 0;
+                for (size_t pos = 0; pos + needle.size() <= lines.size(); ++pos) {
+                    bool match = true;
+                    for (size_t i = 0; i < needle.size() && match; ++i) {
+                        match = lines_match(lines[pos + i], needle[i], level);
+                    }
+                    if (!match) continue;
+                    matches++;
+                    size_t distance = pos > target ? pos - target : target - pos;
+                    size_t score = distance + (pos < last ? lines.size() : 0);
+                    if (best < 0 || score < best_score) {
+                        best = static_cast<long>(pos);
+                        best_score = score;
+                    }
+                }
+                if (matches > 1 && !(hunk.hint_line > 0 && static_cast<size_t>(best) == target)) {
+                    return -1; // Ambiguous; looser levels would only match more
+                }
+                if (best >= 0) {
+                    dropped = drop_front;
+                    hunk.before = needle;
+                    hunk.after.assign(hunk.after.begin() + drop_front, hunk.after.end() - drop_back);
+                    return best;
+                }
+            }
+        }
+        return -1;
+    }
+};
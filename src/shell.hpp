@@ -5,18 +5,39 @@
 #include <vector>
 #include <array>
 #include <unistd.h>
+#include <poll.h>
+#include <csignal>
+#include <cerrno>
 #include <sys/wait.h>
 #include <cstring>
 
+#include "terminal_output.hpp"
+#include "output_filter.hpp"
+
 class Shell {
 public:
-    // Executes a command and streams output to stdout, returning the full output as string
-    std::string execute(const std::string& command) {
+    // When `fd` becomes readable (see Interrupt), the running command's process
+    // group receives SIGINT
+    void set_cancel_fd(int fd) {
+        cancel_fd = fd;
+    }
+
+    // Executes a command and streams output to stdout, returning the full output as string.
+    // With a `normalizer`, the returned output is its cleaned-up version
+    // instead (the terminal still shows the raw output).
+    // The command runs in its own process group, which owns the terminal while
+    // it runs, so Ctrl-C reaches the command rather than this program. Ctrl-Z
+    // stops that group only; this program then suspends itself as well, so
+    // the user's shell can `fg` both together.
+    std::string execute(const std::string& command, OutputNormalizer* normalizer = nullptr) {
         int pipefd[2]; // Pipe for stdout/stderr
         if (pipe(pipefd) == -1) {
             return "Error: pipe failed";
         }
 
+        // Only hand over the terminal if we are its foreground job
+        bool interactive = isatty(STDIN_FILENO) && tcgetpgrp(STDIN_FILENO) == getpgrp();
+
         pid_t pid = fork();
         if (pid == -1) {
             return "Error: fork failed";
@@ -24,6 +45,14 @@ public:
 
         if (pid == 0) {
             // Child process
+            setpgid(0, 0);
+            if (interactive) {
+                signal(SIGTTOU, SIG_IGN);
+                tcsetpgrp(STDIN_FILENO, getpid());
+                signal(SIGTTOU, SIG_DFL);
+            }
+            signal(SIGINT, SIG_DFL);
+
             close(pipefd[0]); // Close read end
             dup2(pipefd[1], STDOUT_FILENO); // Redirect stdout to pipe
             dup2(pipefd[1], STDERR_FILENO); // Redirect stderr to pipe
@@ -41,27 +70,93 @@ public:
             execl(shell_env, shell_env, "-c", command.c_str(), nullptr);
             
             // If execl returns, it failed
-            std::cerr << "Error: exec failed" << std::endl;
-            exit(1);
+            // _exit: the child must not run the parent's atexit/static destructors.
+            // std::cerr may be routed through the terminal writer, whose lock
+            // another thread could have held at fork time, so write directly.
+            const char msg[] = "Error: exec failed\n";
+            (void)!write(STDERR_FILENO, msg, sizeof(msg) - 1);
+            _exit(127);
         } else {
-            // Parent process
+            // Parent process; set the group here too so neither side races the other
+            setpgid(pid, pid);
+            if (interactive) {
+                tcsetpgrp(STDIN_FILENO, pid);
+            }
             close(pipefd[1]); // Close write end
 
             std::string full_output;
             char buffer[1024];
             ssize_t bytes_read;
+            bool signalled = false;
+            int status = 0;
+            bool reaped = false;
+
+            while (true) {
+                // A stopped command keeps the pipe open without writing, so
+                // check on it every so often
+                pollfd fds[2] = {{pipefd[0], POLLIN, 0}, {signalled ? -1 : cancel_fd, POLLIN, 0}};
+                int ready = poll(fds, 2, interactive && !reaped ? 100 : -1);
+                if (interactive && !reaped && waitpid(pid, &status, WNOHANG | WUNTRACED) == pid) {
+                    if (WIFSTOPPED(status)) {
+                        suspend_with(pid);
+                        continue;
+                    }
+                    reaped = true; // Exited; its background children may still write
+                }
+                if (ready < 0) {
+                    if (errno == EINTR) continue;
+                    break;
+                }
+                if (fds[1].revents & POLLIN) {
+                    kill(-pid, SIGINT);
+                    signalled = true;
+                }
+                if (!(fds[0].revents & (POLLIN | POLLHUP | POLLERR))) continue;
 
-            while ((bytes_read = read(pipefd[0], buffer, sizeof(buffer) - 1)) > 0) {
-                buffer[bytes_read] = '\0';
-                std::cout << buffer << std::flush; // Stream to stdout
-                full_output += buffer;
+                bytes_read = read(pipefd[0], buffer, sizeof(buffer));
+                if (bytes_read < 0 && errno == EINTR) continue;
+                if (bytes_read <= 0) break;
+                term_out().write(buffer, bytes_read); // Stream to stdout
+                if (normalizer) {
+                    normalizer->feed(buffer, bytes_read);
+                } else {
+                    full_output.append(buffer, bytes_read);
+                }
             }
+            term_out().flush();
 
             close(pipefd[0]);
-            int status;
-            waitpid(pid, &status, 0);
+            while (!reaped && waitpid(pid, &status, 0) == -1 && errno == EINTR) {
+            }
+
+            if (interactive) {
+                set_foreground(getpgrp()); // Take the terminal back
+            }
             
-            return full_output;
+            return normalizer ? normalizer->finish() : full_output;
         }
     }
+
+private:
+    int cancel_fd = -1;
+
+    // Makes `pgrp` the terminal's foreground group. When taking the terminal
+    // back we are a background group, so SIGTTOU must not stop us.
+    static void set_foreground(pid_t pgrp) {
+        sigset_t block, old;
+        sigemptyset(&block);
+        sigaddset(&block, SIGTTOU);
+        sigprocmask(SIG_BLOCK, &block, &old);
+        tcsetpgrp(STDIN_FILENO, pgrp);
+        sigprocmask(SIG_SETMASK, &old, nullptr);
+    }
+
+    // The command was stopped (Ctrl-Z): stop with it, like a shell job would,
+    // and when continued hand it the terminal back and continue it too
+    static void suspend_with(pid_t pid) {
+        set_foreground(getpgrp());
+        raise(SIGTSTP);
+        set_foreground(pid);
+        kill(-pid, SIGCONT);
+    }
 };
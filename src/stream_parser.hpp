@@ -0,0 +1,253 @@
+#pragma once
+
+#include <string>
+#include <functional>
+#include <initializer_list>
+#include <algorithm>
+#include <cstring>
+
+// Incremental tokenizer for streamed model output.
+//
+// Chunks are fed as they arrive from the model; tags and fences may be split
+// across any number of chunks. Each input byte is examined a bounded number of
+// times, so the cost is linear in the response length and nothing recurses
+// (unlike std::regex with [\s\S]*? on large responses).
+//
+// Events, in stream order:
+//   Text       displayable text (inside or outside <think>, including fences)
+//   ThinkStart / ThinkEnd   around the reasoning section, whether it came as
+//              <think> tags or through feed_thinking()
+//   Execute    a complete ```execute block; text holds the command
+//   Write      a complete ```write:filename block; text holds the content
+//   Patch      a complete ```patch:filename block; text holds the diff
+struct StreamEvent {
+    enum class Type {
+        Text,
+        ThinkStart,
+        ThinkEnd,
+        Execute,
+        Write,
+        Patch
+    };
+
+    Type type;
+    std::string text;
+    std::string filename; // Write and Patch only
+};
+
+class ActionStreamParser {
+public:
+    using EventCallback = std::function<void(const StreamEvent&)>;
+
+    explicit ActionStreamParser(EventCallback on_event) : on_event(std::move(on_event)) {}
+
+    void feed(const std::string& chunk) {
+        if (chunk.empty()) return;
+        if (native_thinking) {
+            native_thinking = false;
+            emit(StreamEvent::Type::ThinkEnd);
+        }
+        pending += chunk;
+        while (!pending.empty()) {
+            bool progressed = false;
+            switch (state) {
+                case State::Text: progressed = scan_text(); break;
+                case State::Think: progressed = scan_think(); break;
+                case State::FenceInfo: progressed = scan_fence_info(); break;
+                case State::Fence: progressed = scan_fence(); break;
+            }
+            if (!progressed) break;
+        }
+    }
+
+    // Reasoning delivered separately from the answer (Ollama's native
+    // "thinking" field); it needs no tag parsing
+    void feed_thinking(const std::string& chunk) {
+        if (chunk.empty()) return;
+        if (!native_thinking) {
+            native_thinking = true;
+            emit(StreamEvent::Type::ThinkStart);
+        }
+        emit_text(chunk);
+    }
+
+    // Flushes held-back text at the end of the stream. Unterminated blocks are
+    // shown but never dispatched.
+    void finish() {
+        emit_text(pending);
+        pending.clear();
+        if (state == State::Think || native_thinking) {
+            emit(StreamEvent::Type::ThinkEnd);
+        }
+        native_thinking = false;
+        state = State::Text;
+    }
+
+private:
+    enum class State {
+        Text,      // Plain answer text
+        Think,     // Inside <think>...</think>
+        FenceInfo, // After ``` until the end of the info string
+        Fence      // Inside a fenced block
+    };
+
+    enum class FenceKind {
+        Plain,
+        Execute,
+        Write,
+        Patch
+    };
+
+    static constexpr const char* THINK_OPEN = "<think>";
+    static constexpr const char* THINK_CLOSE = "</think>";
+    static constexpr const char* FENCE = "```";
+
+    EventCallback on_event;
+    State state = State::Text;
+    std::string pending; // Unconsumed input, at most a partial marker between feeds
+    bool native_thinking = false;
+
+    std::string fence_info;
+    FenceKind fence_kind = FenceKind::Plain;
+    std::string fence_filename;
+    std::string fence_body;
+
+    void emit(StreamEvent::Type type, const std::string& text = "", const std::string& filename = "") {
+        on_event({type, text, filename});
+    }
+
+    void emit_text(const std::string& text) {
+        if (!text.empty()) {
+            emit(StreamEvent::Type::Text, text);
+        }
+    }
+
+    // Length of the longest suffix of `pending` that could still grow into one
+    // of the markers; that much has to be held back until more input arrives.
+    size_t partial_marker_length(std::initializer_list<const char*> markers) const {
+        size_t longest = 0;
+        for (const char* marker : markers) {
+            size_t marker_len = strlen(marker);
+            for (size_t len = std::min(marker_len - 1, pending.size()); len > longest; --len) {
+                if (pending.compare(pending.size() - len, len, marker, len) == 0) {
+                    longest = len;
+                    break;
+                }
+            }
+        }
+        return longest;
+    }
+
+    // Emits everything except a possible partial marker at the end
+    bool emit_all_but_partial(std::initializer_list<const char*> markers, std::string* sink = nullptr) {
+        size_t keep = partial_marker_length(markers);
+        std::string text = pending.substr(0, pending.size() - keep);
+        if (sink) *sink += text;
+        emit_text(text);
+        pending.erase(0, pending.size() - keep);
+        return false;
+    }
+
+    bool scan_text() {
+        size_t think = pending.find(THINK_OPEN);
+        size_t fence = pending.find(FENCE);
+        if (think == std::string::npos && fence == std::string::npos) {
+            return emit_all_but_partial({THINK_OPEN, FENCE});
+        }
+        if (think < fence) {
+            emit_text(pending.substr(0, think));
+            pending.erase(0, think + strlen(THINK_OPEN));
+            emit(StreamEvent::Type::ThinkStart);
+            state = State::Think;
+        } else {
+            emit_text(pending.substr(0, fence + 3));
+            pending.erase(0, fence + 3);
+            fence_info.clear();
+            state = State::FenceInfo;
+        }
+        return true;
+    }
+
+    bool scan_think() {
+        size_t end = pending.find(THINK_CLOSE);
+        if (end == std::string::npos) {
+            return emit_all_but_partial({THINK_CLOSE});
+        }
+        emit_text(pending.substr(0, end));
+        pending.erase(0, end + strlen(THINK_CLOSE));
+        emit(StreamEvent::Type::ThinkEnd);
+        state = State::Text;
+        return true;
+    }
+
+    bool scan_fence_info() {
+        size_t newline = pending.find('\n');
+        size_t fence = pending.find(FENCE);
+        if (newline == std::string::npos && fence == std::string::npos) {
+            return emit_all_but_partial({FENCE}, &fence_info);
+        }
+        if (newline < fence) {
+            fence_info += pending.substr(0, newline);
+            emit_text(pending.substr(0, newline + 1));
+            pending.erase(0, newline + 1);
+            start_fence_body();
+            if (!fence_body.empty()) fence_body += '\n';
+            state = State::Fence;
+        } else {
+            // Single-line block such as ```execute ls```
+            fence_info += pending.substr(0, fence);
+            emit_text(pending.substr(0, fence + 3));
+            pending.erase(0, fence + 3);
+            start_fence_body();
+            close_fence();
+        }
+        return true;
+    }
+
+    bool scan_fence() {
+        size_t end = pending.find(FENCE);
+        if (end == std::string::npos) {
+            return emit_all_but_partial({FENCE}, &fence_body);
+        }
+        fence_body += pending.substr(0, end);
+        emit_text(pending.substr(0, end + 3));
+        pending.erase(0, end + 3);
+        close_fence();
+        return true;
+    }
+
+    // Classifies the block from its info string ("execute", "write:path", "patch:path", ...).
+    // Anything after the first word is treated as the start of the body.
+    void start_fence_body() {
+        size_t start = fence_info.find_first_not_of(" \t\r");
+        std::string info = start == std::string::npos ? "" : fence_info.substr(start);
+        size_t word_end = info.find_first_of(" \t\r");
+        std::string word = info.substr(0, word_end);
+        fence_body = word_end == std::string::npos ? "" : info.substr(word_end + 1);
+
+        fence_filename.clear();
+        if (word == "execute") {
+            fence_kind = FenceKind::Execute;
+        } else if (word.rfind("write:", 0) == 0 && word.size() > 6) {
+            fence_kind = FenceKind::Write;
+            fence_filename = word.substr(6);
+        } else if (word.rfind("patch:", 0) == 0 && word.size() > 6) {
+            fence_kind = FenceKind::Patch;
+            fence_filename = word.substr(6);
+        } else {
+            fence_kind = FenceKind::Plain;
+        }
+    }
+
+    void close_fence() {
+        if (fence_kind == FenceKind::Execute) {
+            emit(StreamEvent::Type::Execute, fence_body);
+        } else if (fence_kind == FenceKind::Write) {
+            emit(StreamEvent::Type::Write, fence_body, fence_filename);
+        } else if (fence_kind == FenceKind::Patch) {
+            emit(StreamEvent::Type::Patch, fence_body, fence_filename);
+        }
+        fence_body.clear();
+        state = State::Text;
+    }
+};
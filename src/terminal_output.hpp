@@ -0,0 +1,363 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <cwchar>
+#include <streambuf>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+
+// Coalescing writer for streamed terminal output.
+//
+// Model tokens and shell output arrive in many tiny pieces. Writing and
+// flushing each one costs a syscall per token, which shows up as CPU use and
+// jitter over SSH and inside tmux. TerminalWriter gathers the pieces and hands
+// them to the kernel with a single writev(2) at most every `interval` (~60 Hz).
+// A newline flushes right away once the interval has elapsed, and a background
+// thread flushes whatever is left when the producer goes idle, so text never
+// waits longer than one interval.
+//
+// Code that writes through std::cout must call flush() first so the two
+// streams stay ordered, unless std::cout is routed through the writer (see
+// TerminalStreambuf).
+//
+// A line editor sharing the terminal registers a TerminalOverlay: while its
+// prompt is on screen, output is written above it. An unterminated line is
+// shown there too, on its own rows, and rewritten in place when the next
+// flush extends it.
+
+// Prompt that output has to be written around (see InputLoop)
+class TerminalOverlay {
+public:
+    virtual ~TerminalOverlay() = default;
+
+    virtual bool prompt_shown() const = 0;
+
+    // Erases the prompt and returns true if it was on screen; end_output()
+    // redraws it once the output is written
+    virtual bool begin_output() = 0;
+    virtual void end_output() = 0;
+};
+
+class TerminalWriter {
+public:
+    explicit TerminalWriter(int fd = STDOUT_FILENO, std::chrono::milliseconds interval = std::chrono::milliseconds(16))
+        : fd(fd), interval(interval), last_flush(Clock::now()) {
+        flusher = std::thread(&TerminalWriter::run, this);
+    }
+
+    ~TerminalWriter() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_one();
+        flusher.join();
+        flush();
+    }
+
+    TerminalWriter(const TerminalWriter&) = delete;
+    TerminalWriter& operator=(const TerminalWriter&) = delete;
+
+    void write(const char* data, size_t len) {
+        if (len == 0) return;
+        // Anything already printed via stdio must reach the terminal first
+        fflush(stdout);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!pending.empty() && pending.back().size() + len <= CHUNK_SIZE) {
+            pending.back().append(data, len);
+        } else {
+            pending.emplace_back(data, len);
+        }
+        pending_bytes += len;
+
+        bool has_newline = memchr(data, '\n', len) != nullptr;
+        bool due = Clock::now() - last_flush >= interval;
+        if ((has_newline && due) || pending_bytes >= MAX_PENDING) {
+            flush_locked();
+        } else {
+            cv.notify_one();
+        }
+    }
+
+    void write(const std::string& text) {
+        write(text.data(), text.size());
+    }
+
+    TerminalWriter& operator<<(const std::string& text) {
+        write(text);
+        return *this;
+    }
+
+    void flush() {
+        std::lock_guard<std::mutex> lock(mutex);
+        flush_locked();
+    }
+
+    // Flushes and makes sure the cursor is at the start of a line, e.g.
+    // before a prompt is drawn
+    void end_line() {
+        std::lock_guard<std::mutex> lock(mutex);
+        bool ends_line = pending.empty() ? line_start : pending.back().back() == '\n';
+        if (!ends_line) {
+            pending.emplace_back("\n");
+            pending_bytes++;
+        }
+        flush_locked();
+    }
+
+    void set_overlay(TerminalOverlay* prompt) {
+        std::lock_guard<std::mutex> lock(mutex);
+        flush_locked();
+        overlay = prompt;
+    }
+
+    // Number of write syscalls issued so far (for benchmarking)
+    size_t syscalls() const {
+        return syscall_count.load();
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr size_t CHUNK_SIZE = 4096;
+    static constexpr size_t MAX_PENDING = 64 * 1024;
+
+    int fd;
+    std::chrono::milliseconds interval;
+    Clock::time_point last_flush;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<std::string> pending;
+    size_t pending_bytes = 0;
+    bool line_start = true; // Last byte written was a newline
+    // Unterminated line drawn above the prompt, and the rows it takes
+    std::string partial;
+    size_t partial_rows = 0;
+    TerminalOverlay* overlay = nullptr;
+    bool stopping = false;
+    std::atomic<size_t> syscall_count{0};
+    std::thread flusher;
+
+    void flush_locked() {
+        last_flush = Clock::now();
+        bool shown = overlay && overlay->prompt_shown();
+        if (pending.empty() && (shown || partial.empty())) return;
+
+        // A partial line drawn earlier is followed by a newline of our own so
+        // the prompt gets a fresh row. Go back up, clear it and write it
+        // again together with its continuation. Once the prompt is gone it is
+        // put back without that newline so output simply continues it.
+        std::string redraw;
+        if (!partial.empty()) {
+            redraw = "\033[" + std::to_string(partial_rows) + "A\r\033[J" + partial;
+        }
+        size_t whole = whole_line_bytes();
+        std::string rest = whole == 0 ? partial : std::string(); // Unterminated line after this write
+        size_t offset = 0;
+        for (const auto& chunk : pending) {
+            if (offset + chunk.size() > whole) rest.append(chunk, whole > offset ? whole - offset : 0, std::string::npos);
+            offset += chunk.size();
+        }
+        line_start = pending.empty() ? false : pending.back().back() == '\n';
+
+        partial.clear();
+        if (shown && !rest.empty()) {
+            partial = std::move(rest);
+            partial_rows = display_rows(partial);
+        }
+
+        bool hidden = shown && overlay->begin_output();
+        write_out(pending_bytes, redraw, partial.empty() ? "" : "\n");
+        if (hidden) overlay->end_output();
+    }
+
+    // Terminal rows `line` covers once written from column 0
+    size_t display_rows(const std::string& line) const {
+        winsize ws{};
+        size_t columns = ioctl(fd, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 ? ws.ws_col : 80;
+        size_t column = 0;
+        size_t rows = 1;
+        for (size_t i = 0; i < line.size();) {
+            unsigned char c = line[i];
+            if (c == '\033') {
+                i = skip_escape(line, i);
+                continue;
+            }
+            if (c == '\r') {
+                column -= column % columns;
+                i++;
+                continue;
+            }
+            if (c == '\b') {
+                if (column % columns > 0) column--;
+                i++;
+                continue;
+            }
+            if (c == '\t') {
+                size_t row_start = column - column % columns;
+                column = row_start + std::min(columns - 1, (column % columns / 8 + 1) * 8);
+                i++;
+                continue;
+            }
+            if (c < 0x20 || c == 0x7f) {
+                i++;
+                continue;
+            }
+            // Decode UTF-8 by hand; wcwidth() knows the widths once readline
+            // has set LC_CTYPE, otherwise count one column per character
+            size_t len = c < 0x80 ? 1 : c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : c >= 0xc0 ? 2 : 1;
+            wchar_t wc = len == 1 ? c : c & (0x7f >> len);
+            for (size_t k = 1; k < len && i + k < line.size(); ++k) {
+                wc = (wc << 6) | (line[i + k] & 0x3f);
+            }
+            i += len;
+            int width = c >= 0x80 && c < 0xc0 ? 0 : wcwidth(wc);
+            if (width < 0) width = 1;
+            if (width == 0) continue;
+            if (column % columns + width > columns) column += columns - column % columns; // Wraps early
+            column += width;
+            rows = std::max(rows, (column - 1) / columns + 1);
+        }
+        return rows;
+    }
+
+    // Index just past the escape sequence starting at `i`
+    static size_t skip_escape(const std::string& text, size_t i) {
+        if (i + 1 >= text.size()) return text.size();
+        char kind = text[i + 1];
+        i += 2;
+        if (kind == '[') {
+            while (i < text.size() && !(text[i] >= 0x40 && text[i] <= 0x7e)) i++;
+            return std::min(i + 1, text.size());
+        }
+        if (kind == ']') {
+            while (i < text.size() && text[i] != '\a' && !(text[i] == '\033' && i + 1 < text.size() && text[i + 1] == '\\')) i++;
+            return std::min(i + (i < text.size() && text[i] == '\033' ? 2 : 1), text.size());
+        }
+        return i;
+    }
+
+    // Bytes of pending output up to and including the last newline
+    size_t whole_line_bytes() const {
+        size_t end = pending_bytes;
+        for (auto it = pending.rbegin(); it != pending.rend(); ++it) {
+            end -= it->size();
+            size_t newline = it->rfind('\n');
+            if (newline != std::string::npos) return end + newline + 1;
+        }
+        return 0;
+    }
+
+    // Writes the first `count` pending bytes between `prefix` and `suffix`
+    void write_out(size_t count, const std::string& prefix = "", const std::string& suffix = "") {
+        std::vector<iovec> iov;
+        iov.reserve(pending.size() + 2);
+        if (!prefix.empty()) iov.push_back({const_cast<char*>(prefix.data()), prefix.size()});
+        size_t left = count;
+        for (auto& chunk : pending) {
+            if (left == 0) break;
+            size_t len = std::min(left, chunk.size());
+            iov.push_back({chunk.data(), len});
+            left -= len;
+        }
+        if (!suffix.empty()) iov.push_back({const_cast<char*>(suffix.data()), suffix.size()});
+        if (iov.empty()) return;
+
+        size_t first = 0;
+        while (first < iov.size()) {
+            int iov_count = static_cast<int>(std::min<size_t>(iov.size() - first, IOV_MAX));
+            ssize_t n = ::writev(fd, &iov[first], iov_count);
+            syscall_count++;
+            if (n < 0) {
+                if (errno == EINTR || errno == EAGAIN) continue;
+                break; // Terminal went away; drop the output
+            }
+            // Skip fully written buffers and adjust a partially written one
+            size_t written = static_cast<size_t>(n);
+            while (first < iov.size() && written >= iov[first].iov_len) {
+                written -= iov[first].iov_len;
+                first++;
+            }
+            if (first < iov.size()) {
+                iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + written;
+                iov[first].iov_len -= written;
+            }
+        }
+
+        // Drop the written bytes, keeping the rest of a partly written chunk
+        size_t done = count;
+        size_t chunks = 0;
+        while (done > 0 && done >= pending[chunks].size()) {
+            done -= pending[chunks].size();
+            chunks++;
+        }
+        if (done > 0) pending[chunks].erase(0, done);
+        pending.erase(pending.begin(), pending.begin() + chunks);
+        pending_bytes -= count;
+    }
+
+    // Flushes pending output once it is one interval old
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopping) {
+            if (pending.empty()) {
+                cv.wait(lock);
+                continue;
+            }
+            auto deadline = last_flush + interval;
+            if (Clock::now() >= deadline) {
+                flush_locked();
+            } else {
+                cv.wait_until(lock, deadline);
+            }
+        }
+    }
+};
+
+// Lets std::cout and std::cerr share the writer's ordering and prompt handling
+class TerminalStreambuf : public std::streambuf {
+public:
+    explicit TerminalStreambuf(TerminalWriter& writer) : writer(writer) {}
+
+protected:
+    std::streamsize xsputn(const char* data, std::streamsize len) override {
+        writer.write(data, static_cast<size_t>(len));
+        return len;
+    }
+
+    int_type overflow(int_type c) override {
+        if (!traits_type::eq_int_type(c, traits_type::eof())) {
+            char ch = traits_type::to_char_type(c);
+            writer.write(&ch, 1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    int sync() override {
+        writer.flush();
+        return 0;
+    }
+
+private:
+    TerminalWriter& writer;
+};
+
+// Shared writer for the model stream and shell output
+inline TerminalWriter& term_out() {
+    static TerminalWriter writer;
+    return writer;
+}